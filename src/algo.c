@@ -18,10 +18,20 @@
 
 #include "tg.h"
 
+#define BLOCK 8
+#define SCRATCH_ALIGN 64
+
+/* A biquad, run BLOCK samples at a time, see run_filter() */
 struct filter {
 	double a0,a1,a2,b1,b2;
+	int single;		//!< Run in single precision
+	double ys[2][BLOCK];	//!< Contribution of the state to the block output
+	double yx[BLOCK][BLOCK]; //!< Contribution of each input to the block output
 };
 
+typedef float v8sf __attribute__((vector_size(8 * sizeof(float))));
+typedef double v4df __attribute__((vector_size(4 * sizeof(double))));
+
 static int int_cmp(const void *a, const void *b)
 {
 	int x = *(int*)a;
@@ -29,6 +39,36 @@ static int int_cmp(const void *a, const void *b)
 	return x<y ? -1 : x>y ? 1 : 0;
 }
 
+/* The filter in transposed direct form II has state s = (z1, z2) and
+ *
+ *	y = a0 x + z1
+ *	s' = F s + G x,  F = [ -b1 1 ; -b2 0 ],  G = (a1 - b1 a0, a2 - b2 a0)
+ *
+ * so the k-th output of a block is a linear function of the state before the
+ * block and of the inputs up to k.  Computing the coefficients once turns the
+ * recursion into products of vectors, of which only the state at the end of
+ * the block depends on the previous block. */
+static void make_block(struct filter *f)
+{
+	double g[2] = { f->a1 - f->b1 * f->a0, f->a2 - f->b2 * f->a0 };
+	f->single = 0;
+	double r[BLOCK][2]; // r[k] = (1 0) F^k
+	int j, k;
+	r[0][0] = 1;
+	r[0][1] = 0;
+	for(k = 1; k < BLOCK; k++) {
+		r[k][0] = -f->b1 * r[k-1][0] - f->b2 * r[k-1][1];
+		r[k][1] = r[k-1][0];
+	}
+	for(k = 0; k < BLOCK; k++) {
+		f->ys[0][k] = r[k][0];
+		f->ys[1][k] = r[k][1];
+		for(j = 0; j < BLOCK; j++)
+			f->yx[j][k] = j > k ? 0 : j == k ? f->a0 :
+				r[k-1-j][0] * g[0] + r[k-1-j][1] * g[1];
+	}
+}
+
 static void make_hp(struct filter *f, double freq)
 {
 	double K = tan(M_PI * freq);
@@ -38,6 +78,7 @@ static void make_hp(struct filter *f, double freq)
 	f->a2 = f->a0;
 	f->b1 = 2 * (K * K - 1) * norm;
 	f->b2 = (1 - K * sqrt(2) + K * K) * norm;
+	make_block(f);
 }
 
 static void make_lp(struct filter *f, double freq)
@@ -49,75 +90,658 @@ static void make_lp(struct filter *f, double freq)
 	f->a2 = f->a0;
 	f->b1 = 2 * (K * K - 1) * norm;
 	f->b2 = (1 - K * sqrt(2) + K * K) * norm;
+	make_block(f);
 }
 
-static void run_filter(struct filter *f, float *buff, int size)
+/* The plain recursion, for the samples that do not fill a block */
+static void run_filter_scalar(struct filter *f, double *z, const float *in, float *out, int size)
 {
 	int i;
-	double z1 = 0, z2 = 0;
+	double z1 = z[0], z2 = z[1];
 	for(i=0; i<size; i++) {
-		double in = buff[i];
-		double out = in * f->a0 + z1;
-		z1 = in * f->a1 + z2 - f->b1 * out;
-		z2 = in * f->a2 - f->b2 * out;
-		buff[i] = out;
+		double x = in[i];
+		double y = x * f->a0 + z1;
+		z1 = x * f->a1 + z2 - f->b1 * y;
+		z2 = x * f->a2 - f->b2 * y;
+		out[i] = y;
+	}
+	z[0] = z1;
+	z[1] = z2;
+}
+
+static void run_filter_float(struct filter *f, double *z, const float *in, float *out, int size)
+{
+	v8sf ys0, ys1, yx[8];
+	int i, j;
+	for(i = 0; i < 8; i++) {
+		ys0[i] = f->ys[0][i];
+		ys1[i] = f->ys[1][i];
+		for(j = 0; j < 8; j++)
+			yx[j][i] = f->yx[j][i];
+	}
+	const float a1 = f->a1, a2 = f->a2, b1 = f->b1, b2 = f->b2;
+	float z1 = z[0], z2 = z[1];
+	for(i = 0; i + 8 <= size; i += 8) {
+		/* Written out, the compiler does not unroll at -O2 */
+		const float *x = in + i;
+		v8sf u = yx[0] * x[0] + yx[1] * x[1] + yx[2] * x[2] + yx[3] * x[3];
+		v8sf v = yx[4] * x[4] + yx[5] * x[5] + yx[6] * x[6] + yx[7] * x[7];
+		v8sf y = (ys0 * z1 + ys1 * z2) + (u + v);
+		float x6 = x[6], x7 = x[7];
+		memcpy(out + i, &y, sizeof(y));
+		z1 = a1 * x7 + a2 * x6 - b1 * y[7] - b2 * y[6];
+		z2 = a2 * x7 - b2 * y[7];
+	}
+	z[0] = z1;
+	z[1] = z2;
+	run_filter_scalar(f, z, in + i, out + i, size - i);
+}
+
+static void run_filter_double(struct filter *f, double *z, const float *in, float *out, int size)
+{
+	v4df ys0, ys1, yx[4];
+	int i, j;
+	for(i = 0; i < 4; i++) {
+		ys0[i] = f->ys[0][i];
+		ys1[i] = f->ys[1][i];
+		for(j = 0; j < 4; j++)
+			yx[j][i] = f->yx[j][i];
+	}
+	double z1 = z[0], z2 = z[1];
+	for(i = 0; i + 4 <= size; i += 4) {
+		const float *x = in + i;
+		double x2 = x[2], x3 = x[3];
+		v4df y = (ys0 * z1 + ys1 * z2) +
+			(yx[0] * (double)x[0] + yx[1] * (double)x[1] + yx[2] * x2 + yx[3] * x3);
+		z1 = f->a1 * x3 + f->a2 * x2 - f->b1 * y[3] - f->b2 * y[2];
+		z2 = f->a2 * x3 - f->b2 * y[3];
+		for(j = 0; j < 4; j++)
+			out[i + j] = y[j];
+	}
+	z[0] = z1;
+	z[1] = z2;
+	run_filter_scalar(f, z, in + i, out + i, size - i);
+}
+
+/* Filter size samples from in to out, which may be the same buffer.  The state
+ * z of the filter is carried from one call to the next. */
+static void run_filter(struct filter *f, double *z, const float *in, float *out, int size)
+{
+	if(f->single)
+		run_filter_float(f, z, in, out, size);
+	else
+		run_filter_double(f, z, in, out, size);
+}
+
+#ifdef DEBUG
+static double bench_filter(void (*run)(struct filter *, double *, const float *, float *, int),
+		struct filter *f, const float *in, float *out, int size, const float *ref, double *error)
+{
+	int i, reps = 20;
+	double z[2] = {0, 0};
+	int64_t start = g_get_monotonic_time();
+	for(i = 0; i < reps; i++)
+		run(f, z, in, out, size);
+	int64_t time = g_get_monotonic_time() - start;
+	z[0] = z[1] = 0;
+	run(f, z, in, out, size);
+	*error = 0;
+	for(i = 0; i < size; i++)
+		*error = fmax(*error, fabs(out[i] - ref[i]));
+	return (double)reps * size / fmax(time, 1);
+}
+
+/** Print the speed of the filter engines, in millions of samples per second,
+ * and their largest deviation from the plain recursion.  Run by
+ * "tg-timer-dbg bench". */
+void benchmark_filters(void)
+{
+	const int size = 16 * DEFAULT_SAMPLE_RATE;
+	float *in = malloc(size * sizeof(float));
+	float *out = malloc(size * sizeof(float));
+	float *ref = malloc(size * sizeof(float));
+	int i, k;
+	srand(1);
+	for(i = 0; i < size; i++)
+		in[i] = (rand() - RAND_MAX / 2) / (float)RAND_MAX;
+
+	for(k = 0; k < 2; k++) {
+		struct filter f;
+		if(k) make_lp(&f, (double)FILTER_CUTOFF / DEFAULT_SAMPLE_RATE);
+		else make_hp(&f, (double)FILTER_CUTOFF / DEFAULT_SAMPLE_RATE);
+		double z[2] = {0, 0}, error;
+		run_filter_scalar(&f, z, in, ref, size);
+		printf("%s-pass:\n", k ? "low" : "high");
+		printf("\tscalar double  %7.1f Ms/s\n", bench_filter(run_filter_scalar, &f, in, out, size, ref, &error));
+		printf("\tblock double   %7.1f Ms/s", bench_filter(run_filter_double, &f, in, out, size, ref, &error));
+		printf("\terror %g\n", error);
+		printf("\tblock float    %7.1f Ms/s", bench_filter(run_filter_float, &f, in, out, size, ref, &error));
+		printf("\terror %g\n", error);
+	}
+	free(in);
+	free(out);
+	free(ref);
+}
+
+/* Print a line of the report of test_algorithms(), returns 1 if error is
+ * above tolerance */
+static int report(const char *name, double error, double tolerance)
+{
+	int failed = !(error <= tolerance);
+	printf("%-48s %9.3g %s\n", name, error, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+/* The block filters, fed in chunks of random sizes, against the plain
+ * recursion fed at once.  Returns the number of failures. */
+static int test_filters(void)
+{
+	const int size = 4 * DEFAULT_SAMPLE_RATE;
+	float *in = malloc(size * sizeof(float));
+	float *out = malloc(size * sizeof(float));
+	float *ref = malloc(size * sizeof(float));
+	int i, j, k, n, failed = 0;
+	srand(1);
+	for(i = 0; i < size; i++)
+		in[i] = (rand() - RAND_MAX / 2) / (float)RAND_MAX;
+
+	for(k = 0; k < 4; k++) {
+		struct filter f;
+		if(k & 1) make_lp(&f, (double)FILTER_CUTOFF / DEFAULT_SAMPLE_RATE);
+		else make_hp(&f, (double)FILTER_CUTOFF / DEFAULT_SAMPLE_RATE);
+		f.single = k >= 2;
+		double z[2] = {0, 0}, error = 0;
+		run_filter_scalar(&f, z, in, ref, size);
+		z[0] = z[1] = 0;
+		for(i = 0; i < size; i += n) {
+			n = MIN(size - i, rand() % 1000);
+			run_filter(&f, z, in + i, out + i, n);
+		}
+		for(j = 0; j < size; j++)
+			error = fmax(error, fabs(out[j] - ref[j]));
+		char name[64];
+		snprintf(name, sizeof(name), "%s-pass filter, block %s", k & 1 ? "low" : "high",
+				f.single ? "float" : "double");
+		/* The outputs are floats, of magnitude below 1 */
+		failed += report(name, error, f.single ? 1e-6 : 1e-7);
+	}
+	free(in);
+	free(out);
+	free(ref);
+	return failed;
+}
+#endif
+
+/* Odd-offset coefficients of a half-band low-pass FIR (Blackman windowed
+ * sinc).  The even-offset ones are zero, except the central one that is 1/2. */
+static float halfband_taps[(HALFBAND_TAPS + 1) / 4];
+/* The computers of the channels set up their decimators concurrently */
+static pthread_once_t halfband_once = PTHREAD_ONCE_INIT;
+
+static void make_halfband(void)
+{
+	const int m = HALFBAND_TAPS / 2;
+	double sum = 0;
+	int j;
+	for(j = 0; j < (HALFBAND_TAPS + 1) / 4; j++) {
+		int k = 2*j + 1;
+		int n = m + k;
+		double w = 0.42 - 0.5 * cos(2 * M_PI * n / (HALFBAND_TAPS - 1))
+				+ 0.08 * cos(4 * M_PI * n / (HALFBAND_TAPS - 1));
+		halfband_taps[j] = w * sin(M_PI * k / 2) / (M_PI * k);
+		sum += 2 * halfband_taps[j];
+	}
+	for(j = 0; j < (HALFBAND_TAPS + 1) / 4; j++)
+		halfband_taps[j] *= 0.5 / sum;
+}
+
+/** Set up a decimator.
+ *
+ * The decimator is a cascade of half-band filters, each one halving the
+ * sample rate, and it keeps its state across calls to decimate(), so that the
+ * input can be fed in arbitrary chunks.
+ *
+ * @param[out] d The decimator.
+ * @param[in] factor The decimation factor: 1, 2, 4 or 8.
+ */
+void setup_decimator(struct decimator *d, int factor)
+{
+	pthread_once(&halfband_once, make_halfband);
+	memset(d, 0, sizeof(*d));
+	while(factor > 1 && d->stages < MAX_DECIMATION_STAGES) {
+		d->stages++;
+		factor /= 2;
+	}
+}
+
+static int halfband_push(struct halfband *h, float in, float *out)
+{
+	const int m = HALFBAND_TAPS / 2;
+	h->delay[h->pos] = h->delay[h->pos + HALFBAND_TAPS] = in;
+	if(++h->pos == HALFBAND_TAPS) h->pos = 0;
+	h->phase = !h->phase;
+	if(h->phase) return 0;
+
+	/* d[0] is the oldest sample, d[HALFBAND_TAPS - 1] the newest */
+	const float *d = h->delay + h->pos;
+	double y = 0.5 * d[m];
+	int j;
+	for(j = 0; j < (HALFBAND_TAPS + 1) / 4; j++)
+		y += halfband_taps[j] * (d[m - 2*j - 1] + d[m + 2*j + 1]);
+	*out = y;
+	return 1;
+}
+
+/** Feed one sample to a decimator.
+ *
+ * @param[in,out] d The decimator.
+ * @param[in] in The input sample.
+ * @param[out] out Where to store the output sample, if any.
+ * @returns 1 if an output sample was produced, 0 otherwise.
+ */
+int decimate(struct decimator *d, float in, float *out)
+{
+	int i;
+	for(i = 0; i < d->stages; i++)
+		if(!halfband_push(&d->hb[i], in, &in))
+			return 0;
+	*out = in;
+	return 1;
+}
+
+/* FFTW plans are shared by all the processing buffers, of all the computers,
+ * that need a transform of the same kind and size.  Planning is expensive and
+ * not thread safe, while executing a plan on new arrays is both cheap and
+ * thread safe, provided the arrays come from fftwf_malloc().
+ *
+ * A plan is first made with FFTW_ESTIMATE, unless the wisdom saved by an
+ * earlier run has a measured one.  The planner thread then measures the
+ * estimated plans one by one, and swaps them for the measured ones while they
+ * are in use: the users load the plan each time they execute it, and the
+ * replaced plan is kept until nobody uses the shared plan any more. */
+enum transform {
+	FORWARD,	//!< Real to complex
+	INVERSE,	//!< Complex to real
+	COSINE,		//!< Real even to real even, FFTW_REDFT00
+};
+
+static const char *transform_names[] = { "forward", "inverse", "cosine" };
+
+struct shared_plan {
+	enum transform kind;
+	int size;
+	int refs;
+	int measured;		//!< plan is measured, or can not be improved
+	fftwf_plan plan;
+	fftwf_plan retired;	//!< Plan replaced by the planner thread, or NULL
+	struct shared_plan *next;
+};
+
+static struct shared_plan *shared_plans = NULL;
+static pthread_mutex_t plans_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Serializes all the calls to the FFTW planner, taken after plans_mutex */
+static pthread_mutex_t planner_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+	pthread_t thread;
+	bool	running;
+	bool	stop;
+} planner;
+
+/* Call with planner_mutex held */
+static fftwf_plan make_plan(enum transform kind, int size, void *in, void *out, unsigned flags)
+{
+	switch(kind) {
+	case INVERSE:
+		return fftwf_plan_dft_c2r_1d(size, in, out, flags);
+	case COSINE:
+		return fftwf_plan_r2r_1d(size, in, out, FFTW_REDFT00, flags);
+	default:
+		return fftwf_plan_dft_r2c_1d(size, in, out, flags);
+	}
+}
+
+/* Destroy the shared plans that nobody uses, with plans_mutex and
+ * planner_mutex held */
+static void collect_plans()
+{
+	struct shared_plan **p = &shared_plans;
+	while(*p) {
+		struct shared_plan *q = *p;
+		if(!q->refs) {
+			*p = q->next;
+			fftwf_destroy_plan(q->plan);
+			if(q->retired) fftwf_destroy_plan(q->retired);
+			free(q);
+		} else
+			p = &q->next;
+	}
+}
+
+static struct shared_plan *get_plan(enum transform kind, int size, void *in, void *out)
+{
+	struct shared_plan *p;
+	pthread_mutex_lock(&plans_mutex);
+	for(p = shared_plans; p; p = p->next)
+		if(p->kind == kind && p->size == size)
+			break;
+	if(!p) {
+		p = malloc(sizeof(struct shared_plan));
+		p->kind = kind;
+		p->size = size;
+		p->refs = 0;
+		p->retired = NULL;
+		pthread_mutex_lock(&planner_mutex);
+		p->plan = make_plan(kind, size, in, out, FFTW_MEASURE | FFTW_WISDOM_ONLY);
+		p->measured = p->plan != NULL;
+		if(!p->plan)
+			p->plan = make_plan(kind, size, in, out, FFTW_ESTIMATE);
+		pthread_mutex_unlock(&planner_mutex);
+		p->next = shared_plans;
+		shared_plans = p;
 	}
+	p->refs++;
+	pthread_mutex_unlock(&plans_mutex);
+	return p;
+}
+
+static void put_plan(struct shared_plan *plan)
+{
+	pthread_mutex_lock(&plans_mutex);
+	/* The planner thread may hold planner_mutex for a whole measure, so
+	 * while it runs it is left to destroy the plan, see planner_thread() */
+	int locked = 0;
+	if(!--plan->refs)
+		locked = __atomic_load_n(&planner.running, __ATOMIC_ACQUIRE) ?
+			!pthread_mutex_trylock(&planner_mutex) :
+			!pthread_mutex_lock(&planner_mutex);
+	if(locked) {
+		collect_plans();
+		pthread_mutex_unlock(&planner_mutex);
+	}
+	pthread_mutex_unlock(&plans_mutex);
+}
+
+static void execute_r2c(struct shared_plan *p, float *in, fftwf_complex *out)
+{
+	fftwf_execute_dft_r2c(__atomic_load_n(&p->plan, __ATOMIC_ACQUIRE), in, out);
+}
+
+static void execute_c2r(struct shared_plan *p, fftwf_complex *in, float *out)
+{
+	fftwf_execute_dft_c2r(__atomic_load_n(&p->plan, __ATOMIC_ACQUIRE), in, out);
+}
+
+static void execute_r2r(struct shared_plan *p, float *in, float *out)
+{
+	fftwf_execute_r2r(__atomic_load_n(&p->plan, __ATOMIC_ACQUIRE), in, out);
+}
+
+static char *wisdom_file_name()
+{
+	return g_build_filename(g_get_user_config_dir(), WISDOM_FILE_NAME, NULL);
+}
+
+/** Load the FFTW wisdom saved by the planner thread, so that the plans
+ * measured by earlier runs are available at once.  Call before starting the
+ * computers. */
+void load_fft_wisdom()
+{
+	char *name = wisdom_file_name();
+	pthread_mutex_lock(&planner_mutex);
+	if(fftwf_import_wisdom_from_filename(name))
+		debug("FFT: loaded wisdom from %s\n", name);
+	pthread_mutex_unlock(&planner_mutex);
+	g_free(name);
+}
+
+/* Measure the plan of an estimated shared plan, if there is one, and put it
+ * in place.  Returns 0 if there was nothing to do. */
+static int improve_plan()
+{
+	struct shared_plan *p;
+	pthread_mutex_lock(&plans_mutex);
+	for(p = shared_plans; p && (p->measured || !p->refs); p = p->next);
+	enum transform kind = p ? p->kind : FORWARD;
+	int size = p ? p->size : 0;
+	pthread_mutex_unlock(&plans_mutex);
+	if(!p) return 0;
+
+	/* Scratch arrays, since FFTW_MEASURE overwrites them */
+	float *real = fftwf_malloc(size * sizeof(float));
+	fftwf_complex *spectrum = fftwf_malloc((size/2 + 1) * sizeof(fftwf_complex));
+	pthread_mutex_lock(&planner_mutex);
+	fftwf_set_timelimit(FFT_PLAN_TIME_LIMIT);
+	fftwf_plan plan = kind == INVERSE ?
+		make_plan(kind, size, spectrum, real, FFTW_MEASURE) :
+		make_plan(kind, size, real, spectrum, FFTW_MEASURE);
+	fftwf_set_timelimit(FFTW_NO_TIMELIMIT);
+	pthread_mutex_unlock(&planner_mutex);
+	fftwf_free(real);
+	fftwf_free(spectrum);
+	debug("FFT: measured %s plan of size %d\n", transform_names[kind], size);
+
+	pthread_mutex_lock(&plans_mutex);
+	pthread_mutex_lock(&planner_mutex);
+	for(p = shared_plans; p; p = p->next)
+		if(p->kind == kind && p->size == size)
+			break;
+	if(p && !p->measured && plan) {
+		p->retired = p->plan;
+		__atomic_store_n(&p->plan, plan, __ATOMIC_RELEASE);
+	} else if(plan)
+		fftwf_destroy_plan(plan);
+	if(p) p->measured = 1;
+	collect_plans();
+	char *name = wisdom_file_name();
+	if(!fftwf_export_wisdom_to_filename(name))
+		debug("FFT: can not save wisdom to %s\n", name);
+	g_free(name);
+	pthread_mutex_unlock(&planner_mutex);
+	pthread_mutex_unlock(&plans_mutex);
+	return 1;
+}
+
+/* Destroy the shared plans that nobody uses any more */
+static void collect_unused_plans()
+{
+	pthread_mutex_lock(&plans_mutex);
+	pthread_mutex_lock(&planner_mutex);
+	collect_plans();
+	pthread_mutex_unlock(&planner_mutex);
+	pthread_mutex_unlock(&plans_mutex);
+}
+
+static void *planner_thread(void *p)
+{
+	UNUSED(p);
+	while(!__atomic_load_n(&planner.stop, __ATOMIC_ACQUIRE))
+		if(!improve_plan()) {
+			collect_unused_plans();
+			g_usleep(FFT_PLANNER_POLL);
+		}
+	return NULL;
+}
+
+/** Start measuring in the background the FFTW plans that the wisdom does not
+ * have.  The measured plans replace the estimated ones as they become
+ * available, and are saved in the wisdom for the next runs. */
+void start_fft_planner()
+{
+	planner.stop = false;
+	__atomic_store_n(&planner.running,
+			!pthread_create(&planner.thread, NULL, planner_thread, NULL), __ATOMIC_RELEASE);
+	if(!planner.running)
+		debug("FFT: unable to start the planner thread\n");
+}
+
+/** Stop the planner thread, waiting for the plan being measured if any. */
+void stop_fft_planner()
+{
+	if(!planner.running) return;
+	__atomic_store_n(&planner.stop, true, __ATOMIC_RELEASE);
+	pthread_join(planner.thread, NULL);
+	__atomic_store_n(&planner.running, false, __ATOMIC_RELEASE);
+	/* The plans released since its last poll */
+	collect_unused_plans();
+}
+
+/* The smallest even 2^a 3^b 5^c not less than n.  The sizes derived from the
+ * sample rates can have factors of 7 (44100 = 2^2 3^2 5^2 7^2), on which
+ * FFTW is slower than on these by more than the padding costs, and FFTW
+ * computes the real transforms of even sizes as complex ones of half size. */
+static int fft_size(int n)
+{
+	long best = 2 * (long)n, p5, p3, p2;
+	for(p5 = 1; p5 < best; p5 *= 5)
+		for(p3 = p5; p3 < best; p3 *= 3) {
+			for(p2 = 2 * p3; p2 < n; p2 *= 2);
+			if(p2 < best) best = p2;
+		}
+	return best;
+}
+
+/* The greatest lag of the autocorrelation of a window of count samples at
+ * rate that estimate_period() and compute_period() read: the peaks up to 2/3
+ * of the window, and the search of the first peak up to 3/2 of 13/12 of a
+ * second.  The one after is for the interpolation of the peaks. */
+static int max_lag(int rate, int count)
+{
+	return MAX(2 * count / 3, rate * 13 / 8 + rate / 50) + 1;
+}
+
+/* The distances between the segments of a window of count samples whose
+ * pairs have lags up to lag: lag = d * segment + k, with -segment < k < segment */
+static int segment_distances(int lag, int segment, int count)
+{
+	return MIN(count / segment, lag / segment + 2);
+}
+
+/* Complex values from one spectrum of a segment to the next in an array of
+ * them.  The spectra are transformed in place of the one the plan is made on,
+ * so they must keep its alignment. */
+static int spectrum_stride(int segment)
+{
+	const int align = SCRATCH_ALIGN / sizeof(fftwf_complex);
+	return (segment + align) / align * align;
+}
+
+/* Samples of the window of count samples of the envelope once decimated: the
+ * whole segments in it, see setup_front_end() */
+static int coarse_count(int count, int decimation, int segment)
+{
+	return count / decimation / segment * segment;
 }
 
 void setup_buffers(struct processing_buffers *b)
 {
-	b->samples = fftwf_malloc(2 * b->sample_count * sizeof(float));
-	b->samples_sc = malloc(2 * b->sample_count * sizeof(float));
-	b->waveform = malloc(2 * b->sample_rate * sizeof(float));
-	b->waveform_sc = malloc(2 * b->sample_rate * sizeof(float));
-	b->fft = fftwf_malloc((b->sample_count + 1) * sizeof(fftwf_complex));
-	b->sc_fft = fftwf_malloc((b->sample_count + 1) * sizeof(fftwf_complex));
-	b->tic_wf = fftwf_malloc(b->sample_rate * sizeof(float));
-	b->slice_wf = fftwf_malloc(b->sample_rate * sizeof(float));
-	b->tic_fft = fftwf_malloc((b->sample_rate/2 + 1) * sizeof(fftwf_complex));
-	b->slice_fft = fftwf_malloc((b->sample_rate/2 + 1) * sizeof(fftwf_complex));
-	b->tic_c = malloc(2 * b->sample_count * sizeof(float));
-	b->plan_a = fftwf_plan_dft_r2c_1d(2 * b->sample_count, b->samples, b->fft, FFTW_ESTIMATE);
-	b->plan_b = fftwf_plan_dft_c2r_1d(2 * b->sample_count, b->sc_fft, b->samples_sc, FFTW_ESTIMATE);
-	b->plan_c = fftwf_plan_dft_r2c_1d(2 * b->sample_rate, b->waveform, b->sc_fft, FFTW_ESTIMATE);
-	b->plan_d = fftwf_plan_dft_c2r_1d(2 * b->sample_rate, b->sc_fft, b->waveform_sc, FFTW_ESTIMATE);
-	b->plan_e = fftwf_plan_dft_r2c_1d(b->sample_rate, b->tic_wf, b->tic_fft, FFTW_ESTIMATE);
-	b->plan_f = fftwf_plan_dft_r2c_1d(b->sample_rate, b->slice_wf, b->slice_fft, FFTW_ESTIMATE);
-	b->plan_g = fftwf_plan_dft_c2r_1d(b->sample_rate, b->slice_fft, b->slice_wf, FFTW_ESTIMATE);
-	b->hpf = malloc(sizeof(struct filter));
-	make_hp(b->hpf,(double)FILTER_CUTOFF/b->sample_rate);
-	b->lpf = malloc(sizeof(struct filter));
-	make_lp(b->lpf,(double)FILTER_CUTOFF/b->sample_rate);
+	/* Zero padding to the fast sizes leaves the correlations unchanged,
+	 * the transforms only need to be long enough for them not to wrap */
+	const int m = coarse_count(b->sample_count, b->decimation, b->segment);
+	b->max_lag = max_lag(b->sample_rate / b->decimation, m);
+	b->distances = segment_distances(b->max_lag, b->segment, m);
+	/* The segments that the tapers at the two ends of the window overlap,
+	 * wherever the window starts in the first one */
+	b->edges = 2 * (b->sample_rate / 10 / b->decimation / b->segment + 2);
+	b->wf_fft_size = fft_size(2 * b->sample_rate);
+	b->slice_size = fft_size(b->sample_rate);
+	b->waveform = fftwf_malloc(b->wf_fft_size * sizeof(float));
+	b->taper = malloc(b->sample_rate/10 * sizeof(float));
+	int i;
+	for(i = 0; i < b->sample_rate/10; i++)
+		b->taper[i] = ( 1 - cos(i*M_PI/(b->sample_rate/10)) ) / 2;
 	b->events = malloc(EVENTS_MAX * sizeof(uint64_t));
 	b->ready = 0;
+	b->tracker.locked = 0;
 #ifdef DEBUG
-	b->debug_size = b->sample_count;
+	b->debug_size = b->max_lag + 1;
 	b->debug = fftwf_malloc(b->debug_size * sizeof(float));
 #endif
 }
 
+/* Take size bytes at *pos of the scratch space, or only count them if base is
+ * NULL.  The buffers keep the alignment of fftwf_malloc(), which the shared
+ * plans rely on. */
+static void *carve(char *base, size_t *pos, size_t size)
+{
+	void *p = base ? base + *pos : NULL;
+	*pos += (size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+	return p;
+}
+
+/* Point the scratch buffers of b into base, returns the bytes they take */
+static size_t layout_scratch(struct processing_buffers *b, char *base)
+{
+	size_t pos = 0;
+	/* The slices of do_locate_events() read past the end */
+	b->samples = carve(base, &pos, (b->sample_count + b->slice_size) * sizeof(float));
+	b->segment_c = carve(base, &pos, 2 * b->segment * sizeof(float));
+	b->edge_fft = carve(base, &pos, b->edges * spectrum_stride(b->segment) * sizeof(fftwf_complex));
+	b->cross_sum = carve(base, &pos, 2 * (b->segment + 1) * sizeof(double));
+	b->samples_sc = carve(base, &pos, (b->max_lag + 1) * sizeof(float));
+	/* Also holds the cross spectra of the segments, never longer since
+	 * segments are shorter than a second */
+	b->sc_fft = carve(base, &pos, (b->wf_fft_size/2 + 1) * sizeof(fftwf_complex));
+	b->waveform_sc = carve(base, &pos, b->wf_fft_size * sizeof(float));
+	b->tic_wf = carve(base, &pos, b->slice_size * sizeof(float));
+	b->slice_wf = carve(base, &pos, b->slice_size * sizeof(float));
+	b->tic_fft = carve(base, &pos, (b->slice_size/2 + 1) * sizeof(fftwf_complex));
+	b->slice_fft = carve(base, &pos, (b->slice_size/2 + 1) * sizeof(fftwf_complex));
+	b->tic_c = carve(base, &pos, b->sample_count * sizeof(float));
+	return pos;
+}
+
+/** Allocate the scratch space of the processing buffers of a computer.
+ *
+ * The buffers of the steps are processed one at a time, so they share the
+ * space for the intermediate results of process(), which is sized for the
+ * largest step.  Only the results read after process() returns are kept in
+ * each processing_buffers.  Call after setup_buffers().
+ *
+ * @param b The processing buffers
+ * @param count Number of processing buffers
+ * @return The scratch space, to be freed with scratch_destroy()
+ */
+void *setup_scratch(struct processing_buffers *b, int count)
+{
+	size_t size = 0;
+	int i;
+	for(i = 0; i < count; i++)
+		size = MAX(size, layout_scratch(&b[i], NULL));
+	char *base = fftwf_malloc(size);
+	for(i = 0; i < count; i++) {
+		layout_scratch(&b[i], base);
+		float *power = (float *)b[i].sc_fft;
+		b[i].plan_a = get_plan(INVERSE, 2 * b[i].segment, b[i].sc_fft, b[i].segment_c);
+		b[i].plan_b = get_plan(FORWARD, 2 * b[i].segment, b[i].segment_c, b[i].edge_fft);
+		b[i].plan_c = get_plan(FORWARD, b[i].wf_fft_size, b[i].waveform, b[i].sc_fft);
+		b[i].plan_d = get_plan(COSINE, b[i].wf_fft_size/2 + 1, power, b[i].waveform_sc);
+		b[i].plan_e = get_plan(FORWARD, b[i].slice_size, b[i].tic_wf, b[i].tic_fft);
+		b[i].plan_f = get_plan(FORWARD, b[i].slice_size, b[i].slice_wf, b[i].slice_fft);
+		b[i].plan_g = get_plan(INVERSE, b[i].slice_size, b[i].slice_fft, b[i].slice_wf);
+		debug("step %d: %d segments of %d points, transforms of %d points\n",
+				i, b[i].distances, 2 * b[i].segment, b[i].wf_fft_size);
+	}
+	debug("scratch space of %zu bytes\n", size);
+	return base;
+}
+
+void scratch_destroy(void *scratch)
+{
+	if(scratch) fftwf_free(scratch);
+}
+
 void pb_destroy(struct processing_buffers *b)
 {
-	fftwf_free(b->samples);
-	free(b->samples_sc);
-	free(b->waveform);
-	free(b->waveform_sc);
-	fftwf_free(b->fft);
-	fftwf_free(b->sc_fft);
-	fftwf_free(b->tic_wf);
-	fftwf_free(b->slice_wf);
-	fftwf_free(b->tic_fft);
-	fftwf_free(b->slice_fft);
-	free(b->tic_c);
-	fftwf_destroy_plan(b->plan_a);
-	fftwf_destroy_plan(b->plan_b);
-	fftwf_destroy_plan(b->plan_c);
-	fftwf_destroy_plan(b->plan_d);
-	fftwf_destroy_plan(b->plan_e);
-	fftwf_destroy_plan(b->plan_f);
-	fftwf_destroy_plan(b->plan_g);
-	free(b->hpf);
-	free(b->lpf);
+	fftwf_free(b->waveform);
+	free(b->taper);
+	put_plan(b->plan_a);
+	put_plan(b->plan_b);
+	put_plan(b->plan_c);
+	put_plan(b->plan_d);
+	put_plan(b->plan_e);
+	put_plan(b->plan_f);
+	put_plan(b->plan_g);
 	free(b->events);
 #ifdef DEBUG
 	fftwf_free(b->debug);
@@ -137,6 +761,7 @@ struct processing_buffers *pb_clone(struct processing_buffers *p)
 		new->events = NULL;
 
 #ifdef DEBUG
+	new->decimation = p->decimation;
 	new->debug_size = p->debug_size;
 	if(p->debug) {
 		new->debug = malloc(new->debug_size * sizeof(float));
@@ -262,76 +887,912 @@ static void quickselect(float* x, int n, int k)
 	};
 }
 
-static void noise_suppressor(struct processing_buffers *p)
+/* Map floats to unsigned integers in the same order */
+static uint32_t float_key(float f)
 {
-	float *a = p->samples_sc;
-	float *b = p->samples_sc + p->sample_count;
-	int window = p->sample_rate / 50;
+	uint32_t u;
+	memcpy(&u, &f, sizeof(u));
+	return u & 0x80000000u ? ~u : u | 0x80000000u;
+}
+
+static float key_float(uint32_t key)
+{
+	uint32_t u = key & 0x80000000u ? key & ~0x80000000u : ~key;
+	float f;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+/** Find the value at rank k, without reordering the list.
+ *
+ * Returns the same value as x[k] after quickselect(x, n, k), but leaves x
+ * alone, so that it needs neither a copy of the list nor space for it.  The
+ * values are sorted by their bits, a byte at a time from the most significant
+ * one: a histogram of the bytes of the values that agree with the ones chosen
+ * so far tells which byte the value at rank k has.  It stops as soon as a
+ * single value is left, usually after two or three passes.
+ *
+ * @param[in] x The values.
+ * @param[in] n The number of values.
+ * @param[in] k The rank, 0 for the largest value.
+ * @returns The (k+1)'th largest value.
+ */
+static float nth_greatest(const float *x, int n, int k)
+{
+	uint32_t prefix = 0, mask = 0;
+	int rank = n - 1 - k;	/* Values smaller than the one we want */
+	int shift, i;
+	for(shift = 24; shift >= 0; shift -= 8) {
+		int count[256] = { 0 };
+		for(i = 0; i < n; i++) {
+			uint32_t key = float_key(x[i]);
+			if((key & mask) == prefix)
+				count[(key >> shift) & 0xff]++;
+		}
+		int byte;
+		for(byte = 0; rank >= count[byte]; byte++)
+			rank -= count[byte];
+		prefix |= (uint32_t)byte << shift;
+		mask |= 0xffu << shift;
+		if(count[byte] == 1)
+			for(i = 0; i < n; i++)
+				if((float_key(x[i]) & mask) == prefix)
+					return x[i];
+	}
+	return key_float(prefix);
+}
+
+/* Convert int16 samples to float.  The loop is written with vector types where
+ * the compiler can convert them, since the default flags do not vectorize. */
+static void convert_int16(const int16_t *in, float scale, float *out, int size)
+{
+	int i = 0;
+#ifdef __has_builtin
+#if __has_builtin(__builtin_convertvector)
+	typedef int16_t v8hi __attribute__((vector_size(16)));
+	typedef float v8sf __attribute__((vector_size(32)));
+	for(; i + 8 <= size; i += 8) {
+		v8hi x;
+		memcpy(&x, in + i, sizeof(x));
+		v8sf y = __builtin_convertvector(x, v8sf) * scale;
+		memcpy(out + i, &y, sizeof(y));
+	}
+#endif
+#endif
+	for(; i < size; i++)
+		out[i] = in[i] * scale;
+}
+
+/** Allocate a front end.
+ *
+ * @param fe The front end.
+ * @param sample_rate The sample rate of the audio.
+ * @param counts The sizes of the NSTEPS windows of the analysis, increasing.
+ */
+void setup_front_end(struct front_end *fe, int sample_rate, const int *counts)
+{
+	int size = counts[NSTEPS-1];
+	fe->sample_rate = sample_rate;
+	fe->size = size;
+	memcpy(fe->counts, counts, sizeof(fe->counts));
+	fe->envelope = malloc(2 * size * sizeof(float));
+	/* The envelope is band limited to FILTER_CUTOFF, the period can be
+	 * found at a fraction of the sample rate */
+	fe->decimation = 1;
+	while(2 * fe->decimation <= 1 << MAX_DECIMATION_STAGES &&
+			sample_rate / (2 * fe->decimation) >= COARSE_MIN_RATE &&
+			counts[0] % (2 * fe->decimation) == 0)
+		fe->decimation *= 2;
+	/* The autocorrelation is updated a segment at a time, segments last
+	 * at most CORRELATION_SEGMENT and divide the windows if one half as
+	 * long at least does.  Otherwise, as with a prime rate, the windows
+	 * are cut to whole segments, see coarse_count(), rather than running
+	 * a transform for every few samples. */
+	const int rate = sample_rate / fe->decimation;
+	const int count = counts[0] / fe->decimation;
+	const int longest = MIN(count, rate * CORRELATION_SEGMENT);
+	for(fe->segment = longest; count % fe->segment && fe->segment > longest / 2; fe->segment--);
+	if(count % fe->segment)
+		fe->segment = longest;
+	fe->coarse_size = size / fe->decimation;
+	fe->coarse = malloc(2 * fe->coarse_size * sizeof(float));
+	fe->segment_in = fftwf_malloc(2 * fe->segment * sizeof(float));
+	fe->spectra_count = size / fe->decimation / fe->segment + 1;
+	fe->spectrum_stride = spectrum_stride(fe->segment);
+	fe->spectra = fftwf_malloc(fe->spectra_count * fe->spectrum_stride * sizeof(fftwf_complex));
+	fe->segment_plan = get_plan(FORWARD, 2 * fe->segment, fe->segment_in, fe->spectra);
+	int k;
+	for(k = 0; k < NSTEPS; k++) {
+		const int m = coarse_count(counts[k], fe->decimation, fe->segment);
+		fe->distances[k] = segment_distances(max_lag(rate, m), fe->segment, m);
+		fe->cross[k] = malloc(fe->distances[k] * 2 * (fe->segment + 1) * sizeof(double));
+	}
+	fe->hpf = malloc(sizeof(struct filter));
+	make_hp(fe->hpf,(double)FILTER_CUTOFF/sample_rate);
+	fe->lpf = malloc(sizeof(struct filter));
+	make_lp(fe->lpf,(double)FILTER_CUTOFF/sample_rate);
+	/* The block error of single precision, about 1e-7 of full scale, is
+	 * well below the noise of any recording */
+	fe->hpf->single = fe->lpf->single = 1;
+	fe->window = sample_rate / 50;
+	fe->step = sample_rate / 2;
+	fe->chunk = malloc((fe->window + FRONT_END_CHUNK) * sizeof(float));
+	fe->rectified = malloc(FRONT_END_CHUNK * sizeof(float));
+	fe->energies = malloc(FRONT_END_CHUNK * sizeof(double));
+	fe->max_blocks = size / fe->step > 0 ? size / fe->step : 1;
+	fe->maxima = malloc(fe->max_blocks * sizeof(float));
+	fe->sorted = malloc(fe->max_blocks * sizeof(float));
+	fe->suppress = -1;
+}
+
+void front_end_destroy(struct front_end *fe)
+{
+	free(fe->envelope);
+	free(fe->coarse);
+	fftwf_free(fe->segment_in);
+	fftwf_free(fe->spectra);
+	put_plan(fe->segment_plan);
+	int k;
+	for(k = 0; k < NSTEPS; k++)
+		free(fe->cross[k]);
+	free(fe->chunk);
+	free(fe->hpf);
+	free(fe->lpf);
+	free(fe->rectified);
+	free(fe->energies);
+	free(fe->maxima);
+	free(fe->sorted);
+}
+
+/** Empty the front end, as if it had been fed silence only.
+ *
+ * @param fe The front end.
+ * @param suppress Run the noise suppressor on the samples fed from now on.
+ */
+void reset_front_end(struct front_end *fe, int suppress)
+{
+	memset(fe->envelope, 0, 2 * fe->size * sizeof(float));
+	fe->wp = 0;
+	memset(fe->coarse, 0, 2 * fe->coarse_size * sizeof(float));
+	fe->coarse_wp = 0;
+	setup_decimator(&fe->decimator, fe->decimation);
+	memset(fe->segment_in, 0, 2 * fe->segment * sizeof(float));
+	fe->segment_fill = 0;
+	fe->segments = 0;
+	int k;
+	for(k = 0; k < NSTEPS; k++)
+		memset(fe->cross[k], 0, fe->distances[k] * 2 * (fe->segment + 1) * sizeof(double));
+	fe->hpf_state[0] = fe->hpf_state[1] = 0;
+	fe->lpf_state[0] = fe->lpf_state[1] = 0;
+	memset(fe->sums, 0, sizeof(fe->sums));
+	fe->suppress = suppress;
+	fe->delay = suppress ? fe->window - 1 - fe->window / 2 : 0;
+	memset(fe->chunk, 0, fe->window * sizeof(float));
+	fe->phase = 0;
+	fe->energy = 0;
+	fe->block_max = 0;
+	fe->block_fill = 0;
+	fe->blocks = 0;
+	fe->threshold = INFINITY;
+}
+
+/* Insert the maximum of a block in fe->maxima, replacing the oldest one if
+ * full, and keep fe->sorted in order */
+static void add_block_max(struct front_end *fe, float max)
+{
+	int n = MIN(fe->blocks, fe->max_blocks);
+	int slot = fe->blocks++ % fe->max_blocks;
 	int i;
+	if(n == fe->max_blocks) {
+		for(i = 0; fe->sorted[i] != fe->maxima[slot]; i++);
+		memmove(fe->sorted + i, fe->sorted + i + 1, (--n - i) * sizeof(float));
+	}
+	fe->maxima[slot] = max;
+	for(i = n; i > 0 && fe->sorted[i-1] > max; i--)
+		fe->sorted[i] = fe->sorted[i-1];
+	fe->sorted[i] = max;
+}
 
-	for(i = 0; i < p->sample_count; i++)
-		a[i] = p->samples[i] * p->samples[i];
+/* Silence the bursts of noise louder than the ticks.  The energy of the
+ * signal in a window of 20 ms centered on each sample is compared with the
+ * median of the peak energies of the half seconds seen so far, which are
+ * dominated by the ticks: samples where it is more than twice as much are
+ * zeroed.  Until the first half second after a reset has been seen there is
+ * no median, and nothing is zeroed.  The output, rectified, lags fe->delay
+ * samples behind the input, that is half the window.
+ *
+ * x[-fe->window .. -1] must hold the samples before x[0].  Within a block the
+ * threshold is constant, so only the running sum of the energy is serial. */
+static void noise_suppressor(struct front_end *fe, const float *x, float *out, int size)
+{
+	const int w = fe->window;
+	double *e = fe->energies;
+	int i, j;
+	for(i = 0; i < size; i = j) {
+		int end = MIN(size, i + fe->step - fe->block_fill);
+
+		double energy = fe->energy;
+		for(j = i; j < end; j++) {
+			energy += (double)x[j] * x[j] - (double)x[j-w] * x[j-w];
+			e[j] = energy;
+		}
+		fe->energy = energy;
+
+		const double limit = 2 * fe->threshold;
+		const float *centered = x - fe->delay;
+		double block_max = fe->block_max;
+		for(j = i; j < end; j++) {
+			out[j] = e[j] > limit ? 0 : fabsf(centered[j]);
+			block_max = e[j] > block_max ? e[j] : block_max;
+		}
+		fe->block_max = block_max;
+
+		fe->block_fill += end - i;
+		if(fe->block_fill == fe->step) {
+			add_block_max(fe, fe->block_max);
+			/* The (n/2)-th greatest, as quickselect() */
+			int n = MIN(fe->blocks, fe->max_blocks);
+			fe->threshold = fe->sorted[n - 1 - n/2];
+			fe->block_max = 0;
+			fe->block_fill = 0;
+
+			/* Drop the rounding errors of the running sum, adding
+			 * the samples in the order of their position modulo the
+			 * window, the same whatever the chunks */
+			int k, last = end - 1, phase = (fe->phase + last) % w;
+			fe->energy = 0;
+			for(k = 0; k < w; k++) {
+				float v = x[last - (phase - k + w) % w];
+				fe->energy += (double)v * v;
+			}
+		}
+	}
+	fe->phase = (fe->phase + size) % w;
+}
+
+#ifdef DEBUG
+/* The noise suppressor a sample at a time, with a ring of the window and a
+ * quickselect() of the block maxima, as in test_noise_suppressor() */
+static void plain_noise_suppressor(const struct front_end *fe, const float *x, float *out, int size)
+{
+	const int w = fe->window;
+	float *history = calloc(w, sizeof(float));
+	float *maxima = malloc(fe->max_blocks * sizeof(float));
+	float *sorted = malloc(fe->max_blocks * sizeof(float));
+	double energy = 0, block_max = 0, threshold = INFINITY;
+	int i, j, hp = 0, block_fill = 0, blocks = 0;
+	for(i = 0; i < size; i++) {
+		float y = x[i], old = history[hp];
+		energy += (double)y * y - (double)old * old;
+		history[hp] = y;
+		if(++hp == w) hp = 0;
+		int c = hp - 1 - fe->delay;
+		if(c < 0) c += w;
+		out[i] = energy > 2 * threshold ? 0 : fabsf(history[c]);
+		if(energy > block_max) block_max = energy;
+		if(++block_fill == fe->step) {
+			maxima[blocks++ % fe->max_blocks] = block_max;
+			int n = MIN(blocks, fe->max_blocks);
+			memcpy(sorted, maxima, n * sizeof(float));
+			quickselect(sorted, n, n/2);
+			threshold = sorted[n/2];
+			block_max = 0;
+			block_fill = 0;
+			energy = 0;
+			for(j = 0; j < w; j++)
+				energy += (double)history[j] * history[j];
+		}
+	}
+	free(history);
+	free(maxima);
+	free(sorted);
+}
 
+/* The noise suppressor, fed in chunks of random size, against the plain one
+ * on ticks with bursts of louder noise: they must agree to the bit.  Returns
+ * the number of failures. */
+static int test_noise_suppressor(void)
+{
+	const int rate = DEFAULT_SAMPLE_RATE, size = 20 * rate;
+	int counts[NSTEPS], i, k, n;
+	for(k = 0; k < NSTEPS; k++)
+		counts[k] = rate << (k + FIRST_STEP);
+	struct front_end fe;
+	setup_front_end(&fe, rate, counts);
+	reset_front_end(&fe, 1);
+
+	/* The window before the samples is silent, as after a reset */
+	float *x = calloc(fe.window + size, sizeof(float));
+	float *out = malloc(size * sizeof(float));
+	float *ref = malloc(size * sizeof(float));
+	/* The ticks vary, and the bursts grow from below the threshold to
+	 * well above it */
+	srand(2);
+	float level = 0;
+	for(i = 0; i < size; i++) {
+		float noise = (rand() - RAND_MAX / 2) / (float)RAND_MAX;
+		int tick = i % (rate / 6), burst = i % (2 * rate);
+		if(!tick) level = 0.4 + 0.2 * rand() / (float)RAND_MAX;
+		x[fe.window + i] = noise * (tick < rate / 200 ? level :
+				burst < rate / 10 ? 0.1 + 0.1 * i / rate : 0.01);
+	}
+
+	for(i = 0; i < size; i += n) {
+		n = MIN(size - i, 1 + rand() % FRONT_END_CHUNK);
+		noise_suppressor(&fe, x + fe.window + i, out + i, n);
+	}
+	plain_noise_suppressor(&fe, x + fe.window, ref, size);
+
+	int differ = 0, zeroed = 0;
+	for(i = 0; i < size; i++) {
+		differ += out[i] != ref[i];
+		zeroed += !ref[i];
+	}
+	int failed = report("noise suppressor, samples unlike the plain one", differ, 0);
+	failed += report("noise suppressor, bursts not silenced", zeroed < rate / 10, 0);
+
+	free(x);
+	free(out);
+	free(ref);
+	front_end_destroy(&fe);
+	return failed;
+}
+
+/* The noise suppressor of the computers before the front end, on a whole
+ * window: the threshold is the median of the peak energies of all the half
+ * seconds of the window, and the output is rectified */
+static void window_noise_suppressor(const float *x, float *out, int size, int rate)
+{
+	const int window = rate / 50, step = rate / 2;
+	const int m = size - window + 1;
+	float *b = malloc(m * sizeof(float));
+	float *maxima = malloc((m / step + 1) * sizeof(float));
 	double r_av = 0;
+	int i, j = 0;
 	for(i = 0; i < window; i++)
-		r_av += a[i];
+		r_av += (double)x[i] * x[i];
 	for(i = 0;; i++) {
 		b[i] = r_av;
-		if(i + window == p->sample_count) break;
-		r_av += a[i + window] - a[i];
+		if(i + window == size) break;
+		r_av += (double)x[i + window] * x[i + window] - (double)x[i] * x[i];
 	}
-
-	int m = p->sample_count - window + 1;
-	int step = p->sample_rate / 2;
-	int j = 0;
 	for(i = 0; i + step - 1 < m; i += step)
-		a[j++] = vmax(b, i, i+step, NULL);
-	quickselect(a, j, j/2);
-	float k = a[j/2];
+		maxima[j++] = vmax(b, i, i + step, NULL);
+	quickselect(maxima, j, j/2);
+	float k = maxima[j/2];
+	for(i = 0; i < size; i++) {
+		int c = i - window / 2;
+		c = c < 0 ? 0 : c > size - window ? size - window : c;
+		out[i] = b[c] > 2*k ? 0 : fabsf(x[i]);
+	}
+	free(b);
+	free(maxima);
+}
 
-	for(i = 0; i < p->sample_count; i++) {
-		int j = i - window / 2;
-		j = j < 0 ? 0 : j > p->sample_count - window ? p->sample_count - window : j;
-		if(b[j] > 2*k) p->samples[i] = 0;
+/* The noise suppressor after a reset, against the one on the whole window
+ * since the reset, on steady ticks with two bursts of louder noise.  Away from
+ * the bursts they must agree to the sample.  The first burst comes before the
+ * end of the first block, when the front end has no threshold yet, and only
+ * it may pass.  At the edges of the second one the energy crosses the two
+ * thresholds, not quite the same, a few samples apart.  Returns the number of
+ * failures. */
+static int test_noise_suppressor_reset(void)
+{
+	const int rate = DEFAULT_SAMPLE_RATE, size = 8 * rate;
+	const int bursts[] = { rate / 5, 5 * rate }, burst = rate / 10;
+	int counts[NSTEPS], i, k;
+	for(k = 0; k < NSTEPS; k++)
+		counts[k] = rate << (k + FIRST_STEP);
+	struct front_end fe;
+	setup_front_end(&fe, rate, counts);
+	reset_front_end(&fe, 1);
+
+	float *x = calloc(fe.window + size, sizeof(float));
+	float *out = malloc(size * sizeof(float));
+	float *ref = malloc(size * sizeof(float));
+	srand(4);
+	for(i = 0; i < size; i++) {
+		float noise = (rand() - RAND_MAX / 2) / (float)RAND_MAX;
+		int in_burst = 0;
+		for(k = 0; k < 2; k++)
+			in_burst |= i >= bursts[k] && i < bursts[k] + burst;
+		x[fe.window + i] = noise * (in_burst ? 2 : i % (rate / 6) < rate / 200 ? 0.5 : 0.01);
 	}
+	for(i = 0; i < size; i += FRONT_END_CHUNK)
+		noise_suppressor(&fe, x + fe.window + i, out + i, MIN(size - i, FRONT_END_CHUNK));
+	window_noise_suppressor(x + fe.window, ref, size, rate);
+
+	/* The output of the front end lags by fe.delay, and the energy of a
+	 * sample reaches half a window around it */
+	int differ[3] = { 0 };
+	for(i = 0; i + fe.delay < size; i++) {
+		if(out[i + fe.delay] == ref[i])
+			continue;
+		for(k = 0; k < 2; k++)
+			if(i >= bursts[k] - fe.window && i < bursts[k] + burst + fe.window)
+				break;
+		differ[k]++;
+	}
+	int failed = report("noise suppressor after reset, unlike the window", differ[2], 0);
+	failed += report("noise suppressor after reset, first burst", differ[0], burst + 2 * fe.window);
+	failed += report("noise suppressor after reset, second burst", differ[1], fe.window / 10);
+
+	free(x);
+	free(out);
+	free(ref);
+	front_end_destroy(&fe);
+	return failed;
 }
+#endif
 
-static void prepare_data(struct processing_buffers *b, int run_noise_suppressor)
+/* c += sign * conj(y) * x, the products in single precision */
+static void add_cross(double *c, const fftwf_complex *y, const fftwf_complex *x, int size, double sign)
 {
 	int i;
+	for(i = 0; i < size; i++) {
+		float ar = crealf(y[i]), ai = cimagf(y[i]);
+		float br = crealf(x[i]), bi = cimagf(x[i]);
+		float re = ar * br + ai * bi, im = ar * bi - ai * br;
+		c[2*i] += sign * re;
+		c[2*i+1] += sign * im;
+	}
+}
 
-	memset(b->samples + b->sample_count, 0, b->sample_count * sizeof(float));
-	run_filter(b->hpf, b->samples, b->sample_count);
-	if(run_noise_suppressor) noise_suppressor(b);
+/* Add the segment in fe->segment_in to the autocorrelations of the windows.
+ *
+ * The autocorrelation of a window is the sum of the cross-correlations of the
+ * pairs of its segments, so the cross spectra of the pairs are summed, by
+ * distance between the segments, in fe->cross.  Each new segment adds its
+ * pairs with the ones before it, and the segment that leaves the window
+ * takes away its pairs with the ones after it, so the cost is proportional
+ * to the new samples and to the lags, and not to the window.  The same float
+ * products are added and later subtracted, so the sums, in double precision,
+ * drift only by its rounding.  The segments before the reset are silent and
+ * have no pairs. */
+static void add_segment(struct front_end *fe)
+{
+	const int h = fe->segment + 1;
+	const int t = fe->segments++;
+	const int stride = fe->spectrum_stride;
+	fftwf_complex *x = fe->spectra + (t % fe->spectra_count) * stride;
+	execute_r2c(fe->segment_plan, fe->segment_in, x);
+
+	int k, d;
+	for(k = 0; k < NSTEPS; k++) {
+		const int o = t - fe->counts[k] / fe->decimation / fe->segment;
+		const fftwf_complex *y = o < 0 ? NULL : fe->spectra + (o % fe->spectra_count) * stride;
+		for(d = 0; d < fe->distances[k]; d++) {
+			double *c = fe->cross[k] + 2 * d * h;
+			if(d <= t)
+				add_cross(c, fe->spectra + ((t - d) % fe->spectra_count) * stride, x, h, 1);
+			if(o >= 0)
+				add_cross(c, y, fe->spectra + ((o + d) % fe->spectra_count) * stride, h, -1);
+		}
+	}
+}
 
-	for(i=0; i < b->sample_count; i++)
-		b->samples[i] = fabs(b->samples[i]);
+/** Feed audio samples to the front end.
+ *
+ * The samples are high-pass filtered, cleaned by the noise suppressor if
+ * enabled, rectified and low-pass filtered, and the resulting envelope is
+ * appended to the ring fe->envelope, and decimated to the ring fe->coarse.  The
+ * filters keep their state across calls, so the cost is proportional to the
+ * new samples only.
+ *
+ * @param fe The front end.
+ * @param in The samples, or NULL.
+ * @param in16 The samples as int16 if in is NULL.
+ * @param scale Multiplier from in16 to float samples.
+ * @param count The number of samples.
+ */
+void run_front_end(struct front_end *fe, const float *in, const int16_t *in16, float scale, int count)
+{
+	/* The noise suppressor looks back a window from the chunk */
+	float *x = fe->chunk + fe->window;
+	float *y = fe->rectified;
+	while(count > 0) {
+		int i, n = MIN(count, FRONT_END_CHUNK);
+		if(in) {
+			run_filter(fe->hpf, fe->hpf_state, in, x, n);
+			in += n;
+		} else {
+			convert_int16(in16, scale, x, n);
+			run_filter(fe->hpf, fe->hpf_state, x, x, n);
+			in16 += n;
+		}
+		if(fe->suppress) {
+			noise_suppressor(fe, x, y, n);
+			memmove(fe->chunk, fe->chunk + n, fe->window * sizeof(float));
+		} else
+			for(i = 0; i < n; i++)
+				y[i] = fabsf(x[i]);
+
+		run_filter(fe->lpf, fe->lpf_state, y, y, n);
+
+		/* Slide the windows by n samples: the samples that leave them
+		 * are still in the ring (n is less than any window) */
+		double in_sum = 0;
+		for(i = 0; i < n; i++)
+			in_sum += y[i];
+		int k;
+		for(k = 0; k < NSTEPS; k++) {
+			const float *out = fe->envelope + fe->size + fe->wp - fe->counts[k];
+			double out_sum = 0;
+			for(i = 0; i < n; i++)
+				out_sum += out[i];
+			fe->sums[k] += in_sum - out_sum;
+		}
 
-	run_filter(b->lpf, b->samples, b->sample_count);
+		/* Keep a copy of the ring after it, so that windows are
+		 * contiguous, see front_end_window() */
+		int len = MIN(n, fe->size - fe->wp);
+		memcpy(fe->envelope + fe->wp, y, len * sizeof(float));
+		memcpy(fe->envelope + fe->size + fe->wp, y, len * sizeof(float));
+		memcpy(fe->envelope, y + len, (n - len) * sizeof(float));
+		memcpy(fe->envelope + fe->size, y + len, (n - len) * sizeof(float));
+		fe->wp = (fe->wp + n) % fe->size;
+		count -= n;
+
+		for(i = 0; i < n; i++) {
+			float v;
+			if(decimate(&fe->decimator, y[i], &v)) {
+				fe->coarse[fe->coarse_wp] = fe->coarse[fe->coarse_size + fe->coarse_wp] = v;
+				if(++fe->coarse_wp == fe->coarse_size) fe->coarse_wp = 0;
+				fe->segment_in[fe->segment_fill++] = v;
+				if(fe->segment_fill == fe->segment) {
+					add_segment(fe);
+					fe->segment_fill = 0;
+				}
+			}
+		}
 
-	double average = 0;
-	for(i=0; i < b->sample_count; i++)
-		average += b->samples[i];
-	average /= b->sample_count;
-	for(i=0; i < b->sample_count; i++)
-		b->samples[i] -= average;
+		/* Once per turn of the ring, drop the rounding errors of the
+		 * running sums */
+		if(fe->wp < n) {
+			for(k = 0; k < NSTEPS; k++) {
+				const float *w = front_end_window(fe, k, NULL);
+				fe->sums[k] = 0;
+				for(i = 0; i < fe->counts[k]; i++)
+					fe->sums[k] += w[i];
+			}
+		}
+	}
+}
 
-	for(i=0; i < b->sample_rate/10; i++) {
-		double k = ( 1 - cos(i*M_PI/(b->sample_rate/10)) ) / 2;
-		b->samples[i] *= k;
-		b->samples[b->sample_count - i - 1] *= k;
+/** The window of a step, the last samples of the envelope.
+ *
+ * The windows of all the steps are suffixes of the same envelope, which is
+ * computed once, and so are their means.
+ *
+ * @param fe The front end.
+ * @param step The step, its window has fe->counts[step] samples.
+ * @param[out] average The mean of the window, if not NULL.
+ * @returns The samples, valid until the next call of run_front_end().
+ */
+const float *front_end_window(struct front_end *fe, int step, double *average)
+{
+	if(average) *average = fe->sums[step] / fe->counts[step];
+	return fe->envelope + fe->size + fe->wp - fe->counts[step];
+}
+
+/** The window of a step in the decimated envelope.
+ *
+ * Like front_end_window(), with the envelope low-passed and decimated by
+ * fe->decimation, delayed by the anti-aliasing filters, and the window cut to
+ * whole segments: coarse_count() samples.
+ *
+ * @param fe The front end.
+ * @param step The step.
+ * @param[out] sums The sums of the cross spectra of the pairs of full segments
+ * that end before the last fe->segment_fill samples, fe->distances[step]
+ * arrays of fe->segment + 1 complex values by distance between the segments,
+ * and the spectra of the segments, see add_segment().
+ * @returns The samples, valid until the next call of run_front_end().
+ */
+const float *front_end_coarse(struct front_end *fe, int step, struct segment_sums *sums)
+{
+	sums->cross = fe->cross[step];
+	sums->spectra = fe->spectra;
+	sums->count = fe->spectra_count;
+	sums->stride = fe->spectrum_stride;
+	sums->segments = fe->segments;
+	sums->fill = fe->segment_fill;
+	return fe->coarse + fe->coarse_size + fe->coarse_wp -
+		coarse_count(fe->counts[step], fe->decimation, fe->segment);
+}
+
+/* Circular autocorrelation of the size samples of in, with the lags from 0 to
+ * size/2 in out.  The power spectrum is real and even, so its inverse transform
+ * is the cosine transform of its first half, which is computed in place of
+ * the spectrum. */
+static void autocorrelation(struct shared_plan *forward, struct shared_plan *cosine,
+		float *in, fftwf_complex *spectrum, float *out, int size)
+{
+	int i;
+	execute_r2c(forward, in, spectrum);
+	/* power[i] overlaps spectrum[i/2], which has been read already */
+	float *power = (float *)spectrum;
+	for(i=0; i < size/2+1; i++) {
+		float re = crealf(spectrum[i]), im = cimagf(spectrum[i]);
+		power[i] = re * re + im * im;
 	}
+	execute_r2r(cosine, power, out);
+}
 
-	fftwf_execute(b->plan_a);
-	for(i=0; i < b->sample_count+1; i++)
-			b->sc_fft[i] = b->fft[i] * conj(b->fft[i]);
-	fftwf_execute(b->plan_b);
+#ifdef DEBUG
+/* autocorrelation() against the inverse complex to real transform of the
+ * power spectrum, on random data.  Returns the number of failures. */
+static int test_autocorrelation(void)
+{
+	const int size = fft_size(2 * DEFAULT_SAMPLE_RATE);
+	float *in = fftwf_malloc(size * sizeof(float));
+	float *out = fftwf_malloc(size * sizeof(float));
+	float *ref = fftwf_malloc(size * sizeof(float));
+	fftwf_complex *spectrum = fftwf_malloc((size/2 + 1) * sizeof(fftwf_complex));
+	struct shared_plan *forward = get_plan(FORWARD, size, in, spectrum);
+	struct shared_plan *cosine = get_plan(COSINE, size/2 + 1, (float *)spectrum, out);
+	struct shared_plan *inverse = get_plan(INVERSE, size, spectrum, ref);
+	int i;
+	srand(3);
+	for(i = 0; i < size; i++)
+		in[i] = (rand() - RAND_MAX / 2) / (float)RAND_MAX;
+
+	execute_r2c(forward, in, spectrum);
+	for(i = 0; i < size/2 + 1; i++)
+		spectrum[i] *= conjf(spectrum[i]);
+	execute_c2r(inverse, spectrum, ref);
+	autocorrelation(forward, cosine, in, spectrum, out, size);
+
+	double error = 0;
+	for(i = 0; i <= size/2; i++)
+		error = fmax(error, fabs(out[i] - ref[i]));
+	/* Relative to the lag 0, the greatest.  Leaving out the last bin of
+	 * the spectrum makes it about 1e-5. */
+	int failed = report("autocorrelation, cosine against complex to real", error / ref[0], 2e-6);
+
+	put_plan(forward);
+	put_plan(cosine);
+	put_plan(inverse);
+	fftwf_free(in);
+	fftwf_free(out);
+	fftwf_free(ref);
+	fftwf_free(spectrum);
+	return failed;
+}
+#endif
+
+/* The sample i of the decimated window as its autocorrelation sees it, in
+ * prepare_data(): tapered like samples, but towards the mean of the window
+ * instead of zero, which is taken away later */
+static float tapered(const struct processing_buffers *b, int i)
+{
+	const int m = coarse_count(b->sample_count, b->decimation, b->segment);
+	const int t = b->sample_rate / 10 / b->decimation;
+	const float *c = b->coarse;
+	const double a = b->coarse_average;
+	if(i < t)
+		return b->taper[i * b->decimation] * (c[i] - a) + a;
+	if(i >= m - t)
+		return b->taper[(m - 1 - i) * b->decimation] * (c[i] - a) + a;
+	return c[i];
+}
+
+static void prepare_data(struct processing_buffers *b)
+{
+	int i;
+
+	/* The envelope and its mean have been computed as the audio came, see
+	 * run_front_end(), what is left is to center and taper the window */
+	const int n = b->sample_count;
+	const int taper = b->sample_rate/10;
+	const float *e = b->envelope;
+	const float average = b->average;
+	for(i=0; i < taper; i++)
+		b->samples[i] = (e[i] - average) * b->taper[i];
+	for(; i < n - taper; i++)
+		b->samples[i] = e[i] - average;
+	for(; i < n; i++)
+		b->samples[i] = (e[i] - average) * b->taper[n - i - 1];
+	memset(b->samples + n, 0, b->slice_size * sizeof(float));
+
+	/* The period comes from the autocorrelation of the decimated window,
+	 * centered and tapered like samples.  The window is cut in blocks on
+	 * the grid of the segments of the front end, the first one starting
+	 * fill samples before it: the sums of the cross spectra of the pairs
+	 * of full segments, see add_segment(), have all of the blocks but the
+	 * last, which is not full yet, and untapered.  So the pairs with a
+	 * block at the edges, the first and the last one among them, are
+	 * taken away and added again with the blocks as they are in the
+	 * window.  Past the window it is zero. */
+	const int seg = b->segment;
+	const int m = coarse_count(n, b->decimation, seg);
+	const int blocks = m / seg;
+	const int lags = MIN(b->max_lag + 1, m);
+	const int stride = b->sums.stride;
+	const int f = b->sums.fill;
+	const int t = taper / b->decimation;
+	double total = 0;
+	for(i = 0; i < m; i++)
+		total += b->coarse[i];
+	const double a = b->coarse_average = total / m;
+
+	int j, k, d;
+	int head = (f + t - 1) / seg, tail = (f + m - t) / seg;
+	const int last = (f + m - 1) / seg;
+	if(tail <= head) tail = head + 1;
+	fftwf_complex *edge[blocks + 1], *full[blocks + 1];
+	for(j = 0; j <= blocks; j++) {
+		const int g = b->sums.segments - blocks + j;
+		full[j] = g < 0 || j == blocks ? NULL :
+			(fftwf_complex *)b->sums.spectra + (g % b->sums.count) * stride;
+		const int slot = j <= head ? j : j >= tail && j <= last ? head + 1 + j - tail : -1;
+		if(slot < 0) {
+			edge[j] = NULL;
+			continue;
+		}
+		edge[j] = b->edge_fft + slot * stride;
+		for(k = 0; k < seg; k++) {
+			const int w = j * seg + k - f;
+			b->segment_c[k] = w >= 0 && w < m ? tapered(b, w) : 0;
+		}
+		memset(b->segment_c + seg, 0, seg * sizeof(float));
+		execute_r2c(b->plan_b, b->segment_c, edge[j]);
+	}
+
+	float *r = b->samples_sc;
+	float *cross = (float *)b->sc_fft;
+	double *sum = b->cross_sum;
+	memset(r, 0, (b->max_lag + 1) * sizeof(float));
+	for(d = 0; d <= blocks && (d - 1) * seg + 1 < lags; d++) {
+		if(d < b->distances)
+			memcpy(sum, b->sums.cross + 2 * d * (seg + 1), 2 * (seg + 1) * sizeof(double));
+		else
+			memset(sum, 0, 2 * (seg + 1) * sizeof(double));
+		for(j = 0; j + d <= blocks; j++) {
+			if(!edge[j] && !edge[j + d])
+				continue;
+			if(full[j] && full[j + d])
+				add_cross(sum, full[j], full[j + d], seg + 1, -1);
+			fftwf_complex *x = edge[j] ? edge[j] : full[j];
+			fftwf_complex *y = edge[j + d] ? edge[j + d] : full[j + d];
+			if(x && y)
+				add_cross(sum, x, y, seg + 1, 1);
+		}
+		for(i = 0; i < 2 * (seg + 1); i++)
+			cross[i] = sum[i] / (2 * seg);
+		execute_c2r(b->plan_a, b->sc_fft, b->segment_c);
+		/* The lag d * seg + k is at k, or at 2 * seg + k if k < 0 */
+		int lo = MAX(1 - seg, -d * seg), hi = MIN(seg - 1, lags - 1 - d * seg);
+		for(k = lo; k < MIN(0, hi + 1); k++)
+			r[d * seg + k] += b->segment_c[2 * seg + k];
+		for(k = MAX(0, lo); k <= hi; k++)
+			r[d * seg + k] += b->segment_c[k];
+	}
+
+	/* Center it: the lag l loses the mean times the sums of the first and
+	 * of the last m - l samples, and gains (m - l) times its square */
+	double first = 0;
+	for(i = 0; i < m; i++)
+		first += tapered(b, i);
+	double second = first;
+	for(i = 0; i < lags; i++) {
+		r[i] -= a * (first + second) - (m - i) * a * a;
+		first -= tapered(b, m - 1 - i);
+		second -= tapered(b, i);
+	}
 
 #ifdef DEBUG
-	memcpy(b->debug, b->samples_sc, b->sample_count * sizeof(float));
+	memcpy(b->debug, b->samples_sc, b->debug_size * sizeof(float));
 #endif
 }
 
+#ifdef DEBUG
+/* Error of the lag l of samples_sc against the sum of the products of y */
+static double lag_error(const struct processing_buffers *b, const double *y, int m, int l)
+{
+	int i;
+	double r = 0;
+	for(i = 0; i + l < m; i++)
+		r += y[i] * y[i + l];
+	return fabs(r - b->samples_sc[l]);
+}
+
+/* The greatest error of the autocorrelation of the decimated window that
+ * prepare_data() puts together from the sums of the front end, against the
+ * one summed directly, relative to its lag 0.  The lags are sampled, with the
+ * ones around the edges of the segments. */
+static double segment_sums_error(const struct processing_buffers *b)
+{
+	const int m = coarse_count(b->sample_count, b->decimation, b->segment);
+	const int lags = MIN(b->max_lag + 1, m);
+	const int seg = b->segment;
+	double *y = malloc(m * sizeof(double));
+	int i, l;
+	for(i = 0; i < m; i++)
+		y[i] = tapered(b, i) - b->coarse_average;
+	double error = lag_error(b, y, m, lags - 1);
+	for(l = 0; l < lags; l += MAX(1, lags / 500))
+		error = MAX(error, lag_error(b, y, m, l));
+	for(l = seg; l + 1 < lags; l += seg) {
+		error = MAX(error, lag_error(b, y, m, l - 1));
+		error = MAX(error, lag_error(b, y, m, l));
+		error = MAX(error, lag_error(b, y, m, l + 1));
+	}
+	double zero = 0;
+	for(i = 0; i < m; i++)
+		zero += y[i] * y[i];
+	free(y);
+	return error / zero;
+}
+
+/* The autocorrelations of the decimated windows that prepare_data() puts
+ * together from the sums the front end keeps as the audio comes, fed in
+ * chunks of random sizes, against the ones summed directly: once shortly
+ * after a reset, when the windows reach before it, and once when they are
+ * full, both with a segment partly filled.  A prime rate has windows that
+ * no segment divides, which are cut to whole segments instead.  Returns the
+ * number of failures. */
+static int test_segment_sums(int rate)
+{
+	const int size = 20 * rate + 1234;
+	const int checks[] = { 3 * rate + 567, size };
+	int counts[NSTEPS], i, k, n, c;
+	for(k = 0; k < NSTEPS; k++)
+		counts[k] = rate << (k + FIRST_STEP);
+	struct front_end fe;
+	setup_front_end(&fe, rate, counts);
+	reset_front_end(&fe, 0);
+	char name[64];
+	snprintf(name, sizeof(name), "segment sums at %d Hz, segment too short", rate);
+	int failed = report(name, fe.segment < rate / fe.decimation * CORRELATION_SEGMENT / 2, 0);
+	struct processing_buffers p[NSTEPS];
+	for(k = 0; k < NSTEPS; k++) {
+		p[k].sample_rate = rate;
+		p[k].sample_count = counts[k];
+		p[k].decimation = fe.decimation;
+		p[k].segment = fe.segment;
+		setup_buffers(&p[k]);
+	}
+	void *scratch = setup_scratch(p, NSTEPS);
+
+	/* Ticks of varying level, a few a second, over some noise */
+	float *x = malloc(size * sizeof(float));
+	srand(3);
+	float level = 0;
+	for(i = 0; i < size; i++) {
+		float noise = (rand() - RAND_MAX / 2) / (float)RAND_MAX;
+		int tick = i % (rate / 6);
+		if(!tick) level = 0.4 + 0.2 * rand() / (float)RAND_MAX;
+		x[i] = noise * (tick < rate / 200 ? level : 0.01);
+	}
+
+	double error = 0;
+	for(i = c = 0; c < 2; c++) {
+		for(; i < checks[c]; i += n) {
+			n = MIN(checks[c] - i, 1 + rand() % FRONT_END_CHUNK);
+			run_front_end(&fe, x + i, NULL, 1, n);
+		}
+		if(!fe.segment_fill)
+			failed += report("segment sums, no segment partly filled", 1, 0);
+		for(k = 0; k < NSTEPS; k++) {
+			p[k].envelope = front_end_window(&fe, k, &p[k].average);
+			p[k].coarse = front_end_coarse(&fe, k, &p[k].sums);
+			prepare_data(&p[k]);
+			error = MAX(error, segment_sums_error(&p[k]));
+		}
+	}
+	snprintf(name, sizeof(name), "segment sums at %d Hz, against the direct one", rate);
+	failed += report(name, error, 1e-6);
+
+	free(x);
+	for(k = 0; k < NSTEPS; k++)
+		pb_destroy(&p[k]);
+	scratch_destroy(scratch);
+	front_end_destroy(&fe);
+	return failed;
+}
+#endif
+
 static int peak_detector(float *buff, int a, int b)
 {
 	int i_max;
@@ -339,10 +1800,7 @@ static int peak_detector(float *buff, int a, int b)
 	if(max <= 0) return -1;
 
 	int i;
-	float v[b-a+1];
-	memcpy(v, buff + a, sizeof(v));
-	quickselect(v, b-a+1, (b-a+1)/2);
-	float med = v[(b-a+1)/2];
+	float med = nth_greatest(buff + a, b-a+1, (b-a+1)/2);
 
 	for(i=a+1; i<i_max; i++)
 		if(buff[i] <= med) break;
@@ -366,13 +1824,29 @@ static int peak_detector(float *buff, int a, int b)
 	return i_max;
 }
 
+/* Rate of the autocorrelation in samples_sc */
+static int coarse_rate(struct processing_buffers *p)
+{
+	return p->sample_rate / p->decimation;
+}
+
+/* Position of the peak at i of x, interpolated with a parabola through the
+ * samples around it */
+static double interpolate_peak(const float *x, int i)
+{
+	double den = x[i-1] - 2 * x[i] + x[i+1];
+	if(den >= 0) return i;
+	return i + 0.5 * (x[i-1] - x[i+1]) / den;
+}
+
 static double estimate_period(struct processing_buffers *p)
 {
+	const int sr = coarse_rate(p);
 	int first_estimate;
-	vmax(p->samples_sc, p->sample_rate / 12, p->sample_rate, &first_estimate);
+	vmax(p->samples_sc, sr / 12, sr, &first_estimate);
 	first_estimate = peak_detector(p->samples_sc,
-			fmax(p->sample_rate / 12, first_estimate - p->sample_rate / 12),
-			first_estimate + p->sample_rate / 12);
+			fmax(sr / 12, first_estimate - sr / 12),
+			first_estimate + sr / 12);
 	if(first_estimate == -1) {
 		debug("no candidate period\n");
 		return -1;
@@ -380,24 +1854,24 @@ static double estimate_period(struct processing_buffers *p)
 	int estimate = first_estimate;
 	int factor = 1;
 	int fct;
-	for(fct = 2; first_estimate / fct > p->sample_rate / 12; fct++) {
+	for(fct = 2; first_estimate / fct > sr / 12; fct++) {
 		int new_estimate = peak_detector(p->samples_sc,
-					first_estimate / fct - p->sample_rate / 50,
-					first_estimate / fct + p->sample_rate / 50);
+					first_estimate / fct - sr / 50,
+					first_estimate / fct + sr / 50);
 		if(new_estimate > -1 && p->samples_sc[new_estimate] > 0.9 * p->samples_sc[first_estimate]) {
 			estimate = new_estimate;
 			factor = fct;
 		}
 	}
-	int a = estimate*3/2 - p->sample_rate / 50;
-	int b = estimate*3/2 + p->sample_rate / 50;
+	int a = estimate*3/2 - sr / 50;
+	int b = estimate*3/2 + sr / 50;
 	double max = vmax(p->samples_sc, a, b+1, NULL);
 	if(max < 0.2 * p->samples_sc[estimate]) {
-		if(first_estimate * 2 / factor < p->sample_rate ) {
+		if(first_estimate * 2 / factor < sr ) {
 			debug("double triggered\n");
 			return peak_detector(p->samples_sc,
-					first_estimate * 2 / factor - p->sample_rate / 50,
-					first_estimate * 2 / factor + p->sample_rate / 50);
+					first_estimate * 2 / factor - sr / 50,
+					first_estimate * 2 / factor + sr / 50);
 		} else {
 			debug("period rejected (immense beat error?)\n");
 			return -1;
@@ -405,20 +1879,49 @@ static double estimate_period(struct processing_buffers *p)
 	} else return estimate;
 }
 
+/* While the period is tracked, the first peak is searched next to the
+ * prediction only, skipping the search of the whole range and the checks of
+ * the harmonics of estimate_period().  The search reaches as far as the gate
+ * of update_tracker(), but never less than the width of a peak.  Once every
+ * TRACK_CHECK measures the period is estimated from scratch anyway, so that a
+ * lock on a wrong peak does not last.  The tracker is only read here, the
+ * steps whose results are not used leave it as it is. */
+static double track_period(struct processing_buffers *b)
+{
+	const struct period_tracker *t = &b->tracker;
+	if(!t->locked || t->cycles >= TRACK_CHECK)
+		return estimate_period(b);
+	const int sr = coarse_rate(b);
+	double q = TRACK_DRIFT * t->period;
+	int width = MAX(sr / 50, ceil(TRACK_GATE * sqrt(t->variance + q * q) / b->decimation));
+	int predicted = round(t->period / b->decimation);
+	int peak = peak_detector(b->samples_sc, MAX(sr / 12, predicted - width),
+			MIN(b->max_lag - 1, predicted + width));
+	if(peak == -1) {
+		debug("tracking lost\n");
+		return estimate_period(b);
+	}
+	return peak;
+}
+
+/* The peaks are searched in the autocorrelation of the decimated envelope, and
+ * interpolated to keep the resolution of the full sample rate */
 static int compute_period(struct processing_buffers *b, int bph)
 {
+	const int sr = coarse_rate(b);
+	const int m = coarse_count(b->sample_count, b->decimation, b->segment);
 	double estimate;
 	if(bph)
 		estimate = peak_detector(b->samples_sc,
-				7200 * b->sample_rate / bph - b->sample_rate / 50,
-				7200 * b->sample_rate / bph + b->sample_rate / 50);
+				7200 * sr / bph - sr / 50,
+				7200 * sr / bph + sr / 50);
 	else
-		estimate = estimate_period(b);
+		estimate = track_period(b);
 	if(estimate == -1) {
 		debug("failed to estimate period\n");
 		return 1;
 	}
-	double delta = b->sample_rate * 0.02;
+	double delta = sr * 0.02;
 	double new_estimate = estimate;
 	double sum = 0;
 	double sq_sum = 0;
@@ -427,20 +1930,20 @@ static int compute_period(struct processing_buffers *b, int bph)
 	for(;;) {
 		int inf = floor(new_estimate * cycle - delta);
 		int sup = ceil(new_estimate * cycle + delta);
-		if(sup > b->sample_count * 2 / 3)
+		if(sup > m * 2 / 3)
 			break;
-		new_estimate = peak_detector(b->samples_sc,inf,sup);
-		if(new_estimate == -1) {
+		int peak = peak_detector(b->samples_sc,inf,sup);
+		if(peak == -1) {
 			debug("cycle = %d peak not found\n",cycle);
 			return 1;
 		}
-		new_estimate /= cycle;
+		new_estimate = interpolate_peak(b->samples_sc, peak) / cycle;
 		if(new_estimate < estimate - delta || new_estimate > estimate + delta) {
-			debug("cycle = %d new_estimate = %f invalid peak\n",cycle,new_estimate/b->sample_rate);
+			debug("cycle = %d new_estimate = %f invalid peak\n",cycle,new_estimate/sr);
 			return 1;
 		} else
-			debug("cycle = %d new_estimate = %f\n",cycle,new_estimate/b->sample_rate);
-		if(inf > b->sample_count / 3) {
+			debug("cycle = %d new_estimate = %f\n",cycle,new_estimate/sr);
+		if(inf > m / 3) {
 			sum += new_estimate;
 			sq_sum += new_estimate * new_estimate;
 			count++;
@@ -448,9 +1951,9 @@ static int compute_period(struct processing_buffers *b, int bph)
 		cycle++;
 	}
 	if(count > 0) estimate = sum / count;
-	b->period = estimate;
+	b->period = estimate * b->decimation;
 	if(count > 1)
-		b->sigma = sqrt((sq_sum - count * estimate * estimate)/ (count-1));
+		b->sigma = sqrt((sq_sum - count * estimate * estimate)/ (count-1)) * b->decimation;
 	else
 		b->sigma = b->period;
 	return 0;
@@ -565,7 +2068,7 @@ static void compute_phase(struct processing_buffers *p, double period)
 static void compute_waveform(struct processing_buffers *p, int wf_size)
 {
 	int i;
-	for(i=0; i<2*p->sample_rate; i++)
+	for(i=0; i<p->wf_fft_size; i++)
 		p->waveform[i] = 0;
 	for(i=0; i < wf_size; i++) {
 		float bin[(int)ceil(1 + p->sample_count / wf_size)];
@@ -595,11 +2098,7 @@ static void prepare_waveform(struct processing_buffers *p)
 	compute_phase(p,p->period/2);
 	compute_waveform(p,ceil(p->period));
 
-	int i;
-	fftwf_execute(p->plan_c);
-	for(i=0; i < p->sample_rate+1; i++)
-			p->sc_fft[i] *= conj(p->sc_fft[i]);
-	fftwf_execute(p->plan_d);
+	autocorrelation(p->plan_c, p->plan_d, p->waveform, p->sc_fft, p->waveform_sc, p->wf_fft_size);
 }
 
 static void prepare_waveform_cal(struct processing_buffers *p)
@@ -683,23 +2182,27 @@ static int compute_parameters(struct processing_buffers *p)
 static void do_locate_events(int *events, struct processing_buffers *p, float *waveform, int last, int offset, int count)
 {
 	int i;
-	memset(p->tic_wf, 0, p->sample_rate * sizeof(float));
+	memset(p->tic_wf, 0, p->slice_size * sizeof(float));
 	for(i=0; i<floor(p->period)/2; i++)
 		p->tic_wf[i] = waveform[i];
-	fftwf_execute(p->plan_e);
+	execute_r2c(p->plan_e, p->tic_wf, p->tic_fft);
 
+	/* Overlap-save: the pulse is at most sample_rate/2 long, so each slice
+	 * gives hop correlation values that do not wrap around */
+	const int hop = p->slice_size - p->sample_rate/2;
 	int s;
-	memset(p->tic_c, 0, 2 * p->sample_count * sizeof(float));
-	for(s = p->sample_count - p->sample_rate/2; s >= 0; s -= p->sample_rate/2) {
-		for(i=0; i < p->sample_rate; i++)
+	memset(p->tic_c, 0, p->sample_count * sizeof(float));
+	for(s = p->sample_count - hop; ; s -= hop) {
+		if(s < 0) s = 0;
+		for(i=0; i < p->slice_size; i++)
 			p->slice_wf[i] = p->samples[i+s];
-		fftwf_execute(p->plan_f);
-		for(i=0; i < p->sample_rate/2+1; i++)
+		execute_r2c(p->plan_f, p->slice_wf, p->slice_fft);
+		for(i=0; i < p->slice_size/2+1; i++)
 			p->slice_fft[i] *= conj(p->tic_fft[i]);
-		fftwf_execute(p->plan_g);
-		for(i=0; i < p->sample_rate/2; i++)
+		execute_c2r(p->plan_g, p->slice_fft, p->slice_wf);
+		for(i=0; i < hop; i++)
 			p->tic_c[i+s] = p->slice_wf[i];
-		if(s < last - offset - (count-1)*p->period - 0.02*p->sample_rate) break;
+		if(!s || s < last - offset - (count-1)*p->period - 0.02*p->sample_rate) break;
 	}
 
 	for(i=0; i<count; i++) {
@@ -895,9 +2398,51 @@ static void compute_cal(struct calibration_data *cd)
 	cd->state = delta * 3600 * 24 < 0.1 ? 1 : -1;
 }
 
-void process(struct processing_buffers *p, int bph, double la, int light)
+/** Update the prediction of the period with the one just measured.
+ *
+ * The prediction is a Kalman filter of a period that drifts at random by
+ * TRACK_DRIFT each cycle, seen with the spread of the cycles of the window.  A
+ * measure more than TRACK_GATE standard deviations from the prediction, or a
+ * failed one, drops the lock and is not used: the next good measure starts
+ * the prediction over.  Every TRACK_CHECK measures taken with the lock, the
+ * next one is estimated from scratch, see track_period().  Call after
+ * process(), only for the steps of the cycle that are used, so that the
+ * predictions do not depend on the steps being run at the same time.
+ *
+ * @param p The processing buffers of the step.
+ */
+void update_tracker(struct processing_buffers *p)
+{
+	struct period_tracker *t = &p->tracker;
+	if(!p->ready || p->sigma >= p->period) {
+		t->locked = 0;
+		return;
+	}
+	double r = p->sigma * p->sigma;
+	if(!t->locked) {
+		t->locked = 1;
+		t->cycles = 0;
+		t->period = p->period;
+		t->variance = r;
+		return;
+	}
+	double q = TRACK_DRIFT * t->period;
+	double v = t->variance + q * q;
+	double innovation = p->period - t->period;
+	if(innovation * innovation > TRACK_GATE * TRACK_GATE * (v + r)) {
+		debug("tracking jumped by %f\n", innovation / p->sample_rate);
+		t->locked = 0;
+		return;
+	}
+	double gain = v / (v + r);
+	t->period += gain * innovation;
+	t->variance = (1 - gain) * v;
+	t->cycles = t->cycles >= TRACK_CHECK ? 0 : t->cycles + 1;
+}
+
+void process(struct processing_buffers *p, int bph, double la)
 {
-	prepare_data(p, !light);
+	prepare_data(p);
 	p->ready = !compute_period(p,bph);
 	if(p->ready && p->period >= p->sample_rate / 2) {
 		debug("Detected period too long\n");
@@ -919,13 +2464,13 @@ void process(struct processing_buffers *p, int bph, double la, int light)
 
 int test_cal(struct processing_buffers *p)
 {
-	prepare_data(p,0);
+	prepare_data(p);
 	return compute_period(p,7200);
 }
 
 int process_cal(struct processing_buffers *p, struct calibration_data *cd)
 {
-	prepare_data(p,0);
+	prepare_data(p);
 	if(compute_period(p,7200)) {
 		debug("abort after compute_period()\n");
 		return 1;
@@ -937,3 +2482,22 @@ int process_cal(struct processing_buffers *p, struct calibration_data *cd)
 		compute_cal(cd);
 	return 0;
 }
+
+#ifdef DEBUG
+/** Check the fast paths of the analysis against the plain computations they
+ * replace, and print a report.  Run by "tg-timer-dbg test".
+ *
+ * @returns The number of checks that failed.
+ */
+int test_algorithms(void)
+{
+	int failed = 0;
+	failed += test_filters();
+	failed += test_noise_suppressor();
+	failed += test_noise_suppressor_reset();
+	failed += test_autocorrelation();
+	failed += test_segment_sums(DEFAULT_SAMPLE_RATE);
+	failed += test_segment_sums(44101);
+	return failed;
+}
+#endif
@@ -16,21 +16,343 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#define _GNU_SOURCE
 #include "tg.h"
 #include <portaudio.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/* Huge buffers of audio, one for each analyzed channel.  Each buffer is a ring
+ * of ring_size samples followed by a mirror of itself, so that any ring_size
+ * consecutive samples are contiguous in memory: the analysis reads its windows
+ * in place, see fill_buffers().  The samples are floats, or int16 scaled by
+ * info.store_scale to halve the memory and its traffic. */
+static void *pa_buffers[MAX_CHANNELS];
+static unsigned ring_size;
+static size_t sample_size;	// bytes per sample in pa_buffers
 
-/* Huge buffer of audio */
-float pa_buffers[PA_BUFF_SIZE];
-int write_pointer = 0;
-uint64_t timestamp = 0;
-pthread_mutex_t audio_mutex;
+/* Position of the writer, published by paudio_callback.  There is a single
+ * writer (the audio callback) and any number of readers, so instead of a mutex
+ * the pair (frames, timestamp) is protected by a sequence counter: the writer
+ * makes it odd while updating, and readers retry until they observe the same
+ * even value before and after reading.  The callback therefore never blocks.
+ */
+static struct ring_position {
+	unsigned seq;
+	unsigned resets;	//!< Number of resets, see reset_position()
+	unsigned gaps;		//!< Number of gaps recorded, see fill_gap()
+	bool	light;		//!< The buffers hold decimated samples
+	uint64_t frames;	//!< Samples written to each buffer since the last reset
+	uint64_t timestamp;	//!< Input frames delivered since the last reset
+} position;
 
 /* Data for PA callback to use */
 static struct callback_info {
 	int 	channels;	//!< Number of channels
-	bool	light;		//!< Light algorithm in use, copy half data
+	int	rings;		//!< Number of buffers, 1 to mix the channels
+	bool	light;		//!< Light algorithm in use, decimate the data
+	bool	input_int16;	//!< The callback gets int16 samples, otherwise float
+	bool	int16;		//!< The buffers hold int16 samples, otherwise float
+	float	store_scale;	//!< Multiplier from float samples to the int16 in the buffers
+	int	decimation;	//!< Decimation factor of the light algorithm
+	struct decimator decimator[MAX_CHANNELS]; //!< Anti-aliasing for light mode
+	bool	request_light;	//!< Mode requested by set_audio_light()
+	bool	reset_done;	//!< Set by the callback once request_light is applied
+	double	next_adc_time;	//!< Expected capture time of the next buffer, 0 if unknown
+	unsigned gaps;		//!< Number of gaps recorded
+	struct audio_stats stats;
+	bool	realtime;	//!< Capturing live audio, see track_drift()
+	uint64_t input_frames;	//!< Input frames since the last gap
+	uint64_t bucket_end;	//!< End of the current bucket of track_drift()
+	int64_t	best_latency;	//!< Least latency seen in the current bucket
+	struct drift_point {
+		uint64_t frames;	//!< Input frames captured
+		int64_t	time;		//!< Monotonic time of the callback that had them, us
+	} best;			//!< Point of the least latency in the current bucket
 } info;
 
+/* Points to estimate the clock of the sound card against the monotonic clock,
+ * see track_drift().  drift_points[n % DRIFT_POINTS] is the n-th point, points
+ * before drift_first belong to an earlier stretch of uninterrupted input. */
+static struct drift_point drift_points[DRIFT_POINTS];
+static unsigned drift_count, drift_first;
+
+/* The last MAX_GAPS discontinuities of the input, gaps[n % MAX_GAPS] is the
+ * n-th one.  Entries are written before position.gaps makes them visible. */
+static struct audio_gap {
+	unsigned resets;	//!< Value of position.resets when the gap happened
+	uint64_t frames;	//!< Position of the gap in the buffers
+	uint64_t length;	//!< Samples of silence written in place of the gap
+} gaps[MAX_GAPS];
+
+static PaStream *stream = NULL;
+static bool pa_initialized = false;
+static int sample_rate_in_use;
+
+static void publish_position(uint64_t frames, uint64_t timestamp)
+{
+	unsigned seq = __atomic_load_n(&position.seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&position.seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&position.gaps, info.gaps, __ATOMIC_RELAXED);
+	__atomic_store_n(&position.frames, frames, __ATOMIC_RELAXED);
+	__atomic_store_n(&position.timestamp, timestamp, __ATOMIC_RELAXED);
+	__atomic_store_n(&position.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Restart the buffers from zero, holding decimated samples if light */
+static void reset_position(bool light)
+{
+	unsigned seq = __atomic_load_n(&position.seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&position.seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&position.resets, position.resets + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&position.light, light, __ATOMIC_RELAXED);
+	__atomic_store_n(&position.frames, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&position.timestamp, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&position.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void read_position(struct ring_position *p)
+{
+	unsigned seq;
+	do {
+		seq = __atomic_load_n(&position.seq, __ATOMIC_ACQUIRE);
+		p->resets = __atomic_load_n(&position.resets, __ATOMIC_RELAXED);
+		p->gaps = __atomic_load_n(&position.gaps, __ATOMIC_RELAXED);
+		p->light = __atomic_load_n(&position.light, __ATOMIC_RELAXED);
+		p->frames = __atomic_load_n(&position.frames, __ATOMIC_RELAXED);
+		p->timestamp = __atomic_load_n(&position.timestamp, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while((seq & 1) || seq != __atomic_load_n(&position.seq, __ATOMIC_RELAXED));
+}
+
+/* Position in the buffers of the last discontinuity, a reset or a gap */
+static uint64_t last_discontinuity(const struct ring_position *pos)
+{
+	unsigned n;
+	for(n = pos->gaps; n > 0 && pos->gaps - n < MAX_GAPS; n--) {
+		const struct audio_gap *g = &gaps[(n - 1) % MAX_GAPS];
+		if(g->resets == pos->resets)
+			return g->frames + g->length;
+	}
+	return 0;
+}
+
+/* Apply a mode change requested by set_audio_light().  Only the writer may
+ * call this.  The buffer is not cleared: readers treat everything older than
+ * the reset as silence, see fill_buffers(). */
+static void apply_light_request(struct callback_info *info)
+{
+	bool light = __atomic_load_n(&info->request_light, __ATOMIC_ACQUIRE);
+	if(light == info->light) return;
+	info->light = light;
+	int i;
+	for(i = 0; i < info->rings; i++)
+		setup_decimator(&info->decimator[i], info->decimation);
+	reset_position(light);
+	__atomic_store_n(&info->reset_done, true, __ATOMIC_RELEASE);
+}
+
+#ifdef _WIN32
+/* There is no portable way to map the same memory twice here, so the mirror is
+ * a copy that the writer keeps up to date */
+static void *map_ring(unsigned size)
+{
+	return calloc(2 * (size_t)size, sample_size);
+}
+
+static void unmap_ring(void *ring, unsigned size)
+{
+	UNUSED(size);
+	free(ring);
+}
+
+static void mirror_ring(void *ring, unsigned from, unsigned count)
+{
+	char *p = ring;
+	unsigned len = MIN(count, ring_size - from);
+	memcpy(p + (ring_size + from) * sample_size, p + from * sample_size, len * sample_size);
+	if(len < count)
+		memcpy(p + ring_size * sample_size, p, (count - len) * sample_size);
+}
+
+static unsigned ring_granularity()
+{
+	return 1;
+}
+#else
+/* Map a zero-filled file twice in a row, so that the mirror is kept up to date
+ * by the MMU */
+static void *map_ring(unsigned size)
+{
+	size_t bytes = (size_t)size * sample_size;
+	int fd;
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create("tg-audio", 0);
+#else
+	char name[] = "/tmp/tg-audio-XXXXXX";
+	fd = mkstemp(name);
+	if(fd >= 0) unlink(name);
+#endif
+	if(fd < 0) return NULL;
+	if(ftruncate(fd, bytes)) {
+		close(fd);
+		return NULL;
+	}
+	char *p = mmap(NULL, 2 * bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(p == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	if(mmap(p, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	   mmap(p + bytes, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(p, 2 * bytes);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	return p;
+}
+
+static void unmap_ring(void *ring, unsigned size)
+{
+	munmap(ring, 2 * (size_t)size * sample_size);
+}
+
+static inline void mirror_ring(void *ring, unsigned from, unsigned count)
+{
+	UNUSED(ring);
+	UNUSED(from);
+	UNUSED(count);
+}
+
+/* The mappings must be page aligned */
+static unsigned ring_granularity()
+{
+	long page = sysconf(_SC_PAGESIZE);
+	return page > 0 ? page / sample_size : 4096 / sample_size;
+}
+#endif
+
+/* Sample k of the interleaved input, as a float */
+static inline float input_value(const struct callback_info *info, const void *input_samples, unsigned long k)
+{
+	if(info->input_int16)
+		return ((const int16_t *)input_samples)[k] * (1.f / 32768);
+	return ((const float *)input_samples)[k];
+}
+
+/* Sample of frame i that goes to buffer r */
+static inline float input_sample(const struct callback_info *info, const void *input_samples, unsigned long i, int r)
+{
+	if(info->rings > 1)
+		return input_value(info, input_samples, i * info->channels + r);
+	return info->channels == 1 ? input_value(info, input_samples, i) :
+		input_value(info, input_samples, 2u*i) + input_value(info, input_samples, 2u*i + 1u);
+}
+
+/* Write the float sample x at position w of buffer r */
+static inline void store_sample(const struct callback_info *info, int r, unsigned w, float x)
+{
+	if(info->int16) {
+		long v = lrintf(x * info->store_scale);
+		((int16_t *)pa_buffers[r])[w] = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+	} else
+		((float *)pa_buffers[r])[w] = x;
+}
+
+/* Replace n lost input frames with silence, so that the timestamps of the
+ * following samples stay right, and record the gap so that the analysis does
+ * not look across it */
+static void fill_gap(struct callback_info *info, uint64_t *frames, uint64_t *timestamp, uint64_t n)
+{
+	uint64_t length = info->light ? n / info->decimation : n;
+	unsigned wp = *frames % ring_size;
+	unsigned count = MIN(length, ring_size);
+	unsigned len = MIN(count, ring_size - wp);
+	int r;
+	for(r = 0; r < info->rings; r++) {
+		memset((char *)pa_buffers[r] + wp * sample_size, 0, len * sample_size);
+		if(len < count)
+			memset(pa_buffers[r], 0, (count - len) * sample_size);
+		mirror_ring(pa_buffers[r], wp, count);
+		if(info->light)
+			setup_decimator(&info->decimator[r], info->decimation);
+	}
+
+	struct audio_gap *g = &gaps[info->gaps % MAX_GAPS];
+	g->resets = position.resets;
+	g->frames = *frames;
+	g->length = length;
+	info->gaps++;
+	*frames += length;
+	*timestamp += n;
+
+	__atomic_store_n(&info->stats.gaps, info->stats.gaps + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&info->stats.lost_frames, info->stats.lost_frames + n, __ATOMIC_RELAXED);
+}
+
+/* Check whether input was lost before the current buffer.  PortAudio flags
+ * the overflows it knows of, the capture time of the buffer tells how long
+ * the gap was, or reveals gaps that were not flagged.  Returns the number of
+ * frames lost, or -1 if there is no gap. */
+static int64_t find_gap(struct callback_info *info, unsigned long frame_count,
+			const PaStreamCallbackTimeInfo *time_info,
+			PaStreamCallbackFlags status_flags)
+{
+	bool overflow = status_flags & paInputOverflow;
+	int64_t lost = overflow ? 0 : -1;
+	if(overflow)
+		__atomic_store_n(&info->stats.overflows, info->stats.overflows + 1, __ATOMIC_RELAXED);
+
+	double period = (double)frame_count / sample_rate_in_use;
+	if(time_info && time_info->inputBufferAdcTime > 0) {
+		double adc_time = time_info->inputBufferAdcTime;
+		if(info->next_adc_time > 0) {
+			double late = adc_time - info->next_adc_time;
+			if(overflow || late > MAX(MAX_ADC_JITTER, period))
+				lost = late > 0 ? llround(late * sample_rate_in_use) : 0;
+		}
+		info->next_adc_time = adc_time + period;
+	}
+	return lost;
+}
+
+/* The callback runs some time after its buffer was captured, with a latency
+ * that varies but never goes below a certain value.  So of the callbacks of
+ * each DRIFT_BUCKET seconds of input only the one with the least latency is kept
+ * as a point of the line of the input frames against the monotonic time, see
+ * get_clock_drift().  A gap in the input starts a new line. */
+static void track_drift(struct callback_info *info, unsigned long frame_count, bool gap)
+{
+	if(!info->realtime) return;
+	int64_t now = g_get_monotonic_time();
+
+	if(gap || !info->bucket_end) {
+		info->input_frames = 0;
+		info->bucket_end = DRIFT_BUCKET * sample_rate_in_use;
+		info->best_latency = INT64_MAX;
+		__atomic_store_n(&drift_first, drift_count, __ATOMIC_RELEASE);
+	}
+
+	info->input_frames += frame_count;
+	int64_t latency = now - (int64_t)(info->input_frames * 1e6 / sample_rate_in_use);
+	if(latency < info->best_latency) {
+		info->best_latency = latency;
+		info->best.frames = info->input_frames;
+		info->best.time = now;
+	}
+	if(info->input_frames >= info->bucket_end) {
+		drift_points[drift_count % DRIFT_POINTS] = info->best;
+		__atomic_store_n(&drift_count, drift_count + 1, __ATOMIC_RELEASE);
+		info->bucket_end += DRIFT_BUCKET * sample_rate_in_use;
+		info->best_latency = INT64_MAX;
+	}
+}
+
 static int paudio_callback(const void *input_buffer,
 			   void *output_buffer,
 			   unsigned long frame_count,
@@ -39,90 +361,187 @@ static int paudio_callback(const void *input_buffer,
 			   void *data)
 {
 	UNUSED(output_buffer);
-	UNUSED(time_info);
-	UNUSED(status_flags);
-	const float *input_samples = (const float*)input_buffer;
+	const void *input_samples = input_buffer;
 	unsigned long i;
-	const struct callback_info *info = data;
-	unsigned wp = write_pointer;
+	int r;
+	struct callback_info *info = data;
+
+	apply_light_request(info);
+
+	uint64_t frames = __atomic_load_n(&position.frames, __ATOMIC_RELAXED);
+	uint64_t timestamp = __atomic_load_n(&position.timestamp, __ATOMIC_RELAXED);
+
+	int64_t lost = find_gap(info, frame_count, time_info, status_flags);
+	if(lost >= 0)
+		fill_gap(info, &frames, &timestamp, lost);
+	track_drift(info, frame_count, lost >= 0);
+
+	const unsigned wp = frames % ring_size;
 
 	if (info->light) {
-		static bool even = true;
-		/* Copy every other sample.  It would be much more efficient to
-		 * just drop the sample rate if the sound hardware supports it.
-		 * This would also avoid the aliasing effects that this simple
-		 * decimation without a low-pass filter causes.  */
-		if(info->channels == 1) {
-			for(i = even ? 0 : 1; i < frame_count; i += 2) {
-				pa_buffers[wp++] = input_samples[i];
-				if (wp >= PA_BUFF_SIZE) wp -= PA_BUFF_SIZE;
-			}
-		} else {
-			for(i = even ? 0 : 2; i < frame_count*2; i += 4) {
-				pa_buffers[wp++] = input_samples[i] + input_samples[i+1];
-				if (wp >= PA_BUFF_SIZE) wp -= PA_BUFF_SIZE;
+		/* Low-pass and decimate, the filter state is kept in
+		 * info->decimator across callbacks. */
+		unsigned written = 0;
+		for(r = 0; r < info->rings; r++) {
+			unsigned w = wp;
+			written = 0;
+			for(i = 0; i < frame_count; i++) {
+				float x = input_sample(info, input_samples, i, r), y;
+				if(decimate(&info->decimator[r], x, &y)) {
+					store_sample(info, r, w, y);
+					if (++w >= ring_size) w = 0;
+					written++;
+				}
 			}
+			mirror_ring(pa_buffers[r], wp, written);
 		}
-		/* Keep track if we have processed an even number of frames, so
-		 * we know if we should drop the 1st or 2nd frame next callback. */
-		if(frame_count % 2) even = !even;
+		frames += written;
 	} else {
-		const unsigned len = MIN(frame_count, PA_BUFF_SIZE - wp);
-		if(info->channels == 1) {
-			memcpy(pa_buffers + wp, input_samples, len * sizeof(*pa_buffers));
-			if(len < frame_count)
-				memcpy(pa_buffers, input_samples + len, (frame_count - len) * sizeof(*pa_buffers));
-		} else {
-			for(i = 0; i < len; i++)
-				pa_buffers[wp + i] = input_samples[2u*i] + input_samples[2u*i + 1u];
-			if(len < frame_count)
+		const unsigned len = MIN(frame_count, ring_size - wp);
+		for(r = 0; r < info->rings; r++) {
+			char *buffer = pa_buffers[r];
+			if(info->channels == 1 && info->input_int16 == info->int16) {
+				/* Same format in and out, see start_portaudio() */
+				const char *in = input_samples;
+				memcpy(buffer + wp * sample_size, in, len * sample_size);
+				if(len < frame_count)
+					memcpy(buffer, in + len * sample_size, (frame_count - len) * sample_size);
+			} else {
+				for(i = 0; i < len; i++)
+					store_sample(info, r, wp + i, input_sample(info, input_samples, i, r));
 				for(i = len; i < frame_count; i++)
-					pa_buffers[i - len] = input_samples[2u*i] + input_samples[2u*i + 1u];
+					store_sample(info, r, i - len, input_sample(info, input_samples, i, r));
+			}
+			mirror_ring(buffer, wp, frame_count);
 		}
-		wp = (wp + frame_count) % PA_BUFF_SIZE;
+		frames += frame_count;
 	}
-	pthread_mutex_lock(&audio_mutex);
-	write_pointer = wp;
-	timestamp += frame_count;
-	pthread_mutex_unlock(&audio_mutex);
+	publish_position(frames, timestamp + frame_count);
 	return 0;
 }
 
-int start_portaudio(int *nominal_sample_rate, double *real_sample_rate)
+static void free_rings()
 {
-	PaStream *stream;
+	int i;
+	for(i = 0; i < info.rings; i++) {
+		unmap_ring(pa_buffers[i], ring_size);
+		pa_buffers[i] = NULL;
+	}
+	info.rings = 0;
+}
 
-	if(pthread_mutex_init(&audio_mutex,NULL)) {
-		error("Failed to setup audio mutex");
-		return 1;
+/* Allocate the buffers, of int16 samples if int16, otherwise of floats.  The
+ * int16 samples use the full range of a channel, or of the sum of two channels
+ * when they are mixed. */
+static int setup_rings(int rings, int sample_rate, bool int16)
+{
+	int i;
+	info.int16 = int16;
+	info.store_scale = rings == 1 && info.channels > 1 ? 16384 : 32768;
+	sample_size = int16 ? sizeof(int16_t) : sizeof(float);
+	unsigned g = ring_granularity();
+	ring_size = (sample_rate * RING_SECONDS + g - 1) / g * g;
+	for(i = 0; i < rings; i++) {
+		pa_buffers[i] = map_ring(ring_size);
+		if(!pa_buffers[i]) {
+			error("Not enough memory for %d audio channels", rings);
+			free_rings();
+			return 1;
+		}
+		info.rings = i + 1;
 	}
+	return 0;
+}
+
+/* The largest decimation factor that keeps the light algorithm above
+ * LIGHT_MIN_SAMPLE_RATE */
+static int light_decimation(int sample_rate)
+{
+	int factor = 1;
+	while(factor < MAX_LIGHT_DECIMATION && sample_rate / (2 * factor) >= LIGHT_MIN_SAMPLE_RATE)
+		factor *= 2;
+	return factor;
+}
+
+/** Start capturing from an audio device.
+ *
+ * @param device The PortAudio index of the device, or -1 for the default
+ * input device.
+ * @param sample_rate The sample rate to request from the device.
+ * @param int16 Capture 16 bit samples and keep them as such in the buffers,
+ * which halves their size.
+ * @param[out] nominal_sample_rate The nominal sample rate.
+ * @param[out] real_sample_rate The sample rate reported by the device.
+ * @param[in,out] channels On input, 0 to mix the (first two) channels of the
+ * device into one buffer, or the number of channels to capture each in its own
+ * buffer.  On output, the number of buffers, see fill_buffers().
+ * @returns 0 on success, 1 on failure.
+ */
+int start_portaudio(int device, int sample_rate, int int16, int *nominal_sample_rate, double *real_sample_rate, int *channels)
+{
+	info.decimation = light_decimation(sample_rate);
 
 	PaError err = Pa_Initialize();
-	if(err!=paNoError)
-		goto error;
+	if(err!=paNoError) {
+		error("Error opening audio input: %s", Pa_GetErrorText(err));
+		return 1;
+	}
+	pa_initialized = true;
 
 #ifdef DEBUG
 	if(testing) {
-		*nominal_sample_rate = PA_SAMPLE_RATE;
-		*real_sample_rate = PA_SAMPLE_RATE;
+		*nominal_sample_rate = sample_rate_in_use = sample_rate;
+		*real_sample_rate = sample_rate;
+		*channels = 1;
+		info.channels = 1;
+		if(setup_rings(1, sample_rate, int16))
+			goto fail;
 		goto end;
 	}
 #endif
 
-	PaDeviceIndex default_input = Pa_GetDefaultInputDevice();
-	if(default_input == paNoDevice) {
+	if(device < 0 || device >= Pa_GetDeviceCount())
+		device = Pa_GetDefaultInputDevice();
+	if(device == paNoDevice) {
 		error("No default audio input device found");
-		return 1;
+		goto fail;
 	}
-	long channels = Pa_GetDeviceInfo(default_input)->maxInputChannels;
-	if(channels == 0) {
-		error("Default audio device has no input channels");
-		return 1;
+	const PaDeviceInfo *device_info = Pa_GetDeviceInfo(device);
+	long max_channels = device_info->maxInputChannels;
+	if(max_channels == 0) {
+		error("Audio device %s has no input channels", device_info->name);
+		goto fail;
+	}
+	if(*channels) {
+		info.channels = MIN(MIN(*channels, max_channels), MAX_CHANNELS);
+		*channels = info.channels;
+	} else {
+		info.channels = MIN(max_channels, 2);
+		*channels = 1;
+	}
+
+	PaStreamParameters params;
+	params.device = device;
+	params.channelCount = info.channels;
+	params.sampleFormat = int16 ? paInt16 : paFloat32;
+	params.suggestedLatency = device_info->defaultLowInputLatency;
+	params.hostApiSpecificStreamInfo = NULL;
+	if(Pa_IsFormatSupported(&params, NULL, sample_rate) != paFormatIsSupported) {
+		error("Audio device %s does not support %d Hz", device_info->name, sample_rate);
+		goto fail;
 	}
-	if(channels > 2) channels = 2;
-	info.channels = channels;
+
+	if(setup_rings(*channels, sample_rate, int16))
+		goto fail;
+	info.input_int16 = int16;
 	info.light = false;
-	err = Pa_OpenDefaultStream(&stream,channels,0,paFloat32,PA_SAMPLE_RATE,paFramesPerBufferUnspecified,paudio_callback,&info);
+	info.request_light = false;
+	info.next_adc_time = 0;
+	memset(&info.stats, 0, sizeof(info.stats));
+	info.realtime = true;
+	info.bucket_end = 0;
+	reset_position(false);
+	err = Pa_OpenStream(&stream,&params,NULL,sample_rate,paFramesPerBufferUnspecified,paNoFlag,paudio_callback,&info);
 	if(err!=paNoError)
 		goto error;
 
@@ -131,7 +550,7 @@ int start_portaudio(int *nominal_sample_rate, double *real_sample_rate)
 		goto error;
 
 	const PaStreamInfo *info = Pa_GetStreamInfo(stream);
-	*nominal_sample_rate = PA_SAMPLE_RATE;
+	*nominal_sample_rate = sample_rate_in_use = sample_rate;
 	*real_sample_rate = info->sampleRate;
 #ifdef DEBUG
 end:
@@ -142,13 +561,45 @@ end:
 
 error:
 	error("Error opening audio input: %s", Pa_GetErrorText(err));
+fail:
+	/* Also closes the stream, if open */
+	terminate_portaudio();
 	return 1;
 }
 
+/** The number of audio devices, valid while PortAudio is running.  */
+int audio_device_count()
+{
+	int n = Pa_GetDeviceCount();
+	return n > 0 ? n : 0;
+}
+
+/** The name of an audio device.
+ *
+ * @param device The PortAudio index of the device.
+ * @returns The name, or NULL if the device has no input channels.
+ */
+const char *audio_device_name(int device)
+{
+	const PaDeviceInfo *device_info = Pa_GetDeviceInfo(device);
+	if(!device_info || !device_info->maxInputChannels)
+		return NULL;
+	return device_info->name;
+}
+
+/** Stop capturing and release PortAudio.  Does nothing if start_portaudio()
+ * failed or was not called.
+ *
+ * @returns 0 on success, 1 on failure.
+ */
 int terminate_portaudio()
 {
+	if(!pa_initialized) return 0;
 	debug("Closing portaudio\n");
+	pa_initialized = false;
 	PaError err = Pa_Terminate();
+	stream = NULL;
+	free_rings();
 	if(err != paNoError) {
 		error("Error closing audio: %s", Pa_GetErrorText(err));
 		return 1;
@@ -156,51 +607,379 @@ int terminate_portaudio()
 	return 0;
 }
 
+/* Audio file read by the batch mode in place of the sound card */
+static struct audio_file {
+	FILE	*f;
+	int	channels;	//!< Channels in the file
+	int	bytes;		//!< Bytes per sample
+	bool	is_float;	//!< IEEE float samples, otherwise signed integers
+	uint64_t data_left;	//!< Bytes of sample data still to be read
+} afile;
+
+static uint32_t le_uint(const unsigned char *b, int bytes)
+{
+	uint32_t x = 0;
+	int i;
+	for(i = bytes - 1; i >= 0; i--)
+		x = x << 8 | b[i];
+	return x;
+}
+
+static float decode_sample(const unsigned char *b)
+{
+	uint32_t x = le_uint(b, afile.bytes);
+	if(afile.is_float) {
+		float f;
+		memcpy(&f, &x, sizeof(f));
+		return f;
+	}
+	int shift = 32 - 8 * afile.bytes;
+	return (int32_t)(x << shift) / 2147483648.f;
+}
+
+/* Parse the header of a RIFF/WAVE file, leaving f at the start of the data.
+ * Returns 0 on success, -1 if f is not a WAV file, and 1 if its samples are
+ * in a format that is not supported. */
+static int open_wav(FILE *f, int *sample_rate)
+{
+	unsigned char b[40];
+	if(fread(b, 1, 12, f) != 12 || memcmp(b, "RIFF", 4) || memcmp(b + 8, "WAVE", 4))
+		return -1;
+	int fmt_found = 0;
+	for(;;) {
+		if(fread(b, 1, 8, f) != 8)
+			return -1;
+		uint32_t size = le_uint(b + 4, 4);
+		if(!memcmp(b, "data", 4)) {
+			if(!fmt_found) return -1;
+			/* Size 0 or -1 means the writer did not know the length */
+			afile.data_left = size && size != 0xffffffff ? size : UINT64_MAX;
+			return 0;
+		}
+		if(!memcmp(b, "fmt ", 4) && size >= 16) {
+			/* The fields past the extensible format are not read */
+			uint32_t n = MIN(size, sizeof(b));
+			if(fread(b, 1, n, f) != n)
+				return -1;
+			int tag = le_uint(b, 2);
+			if(tag == 0xfffe && size >= 26)
+				tag = le_uint(b + 24, 2); // WAVE_FORMAT_EXTENSIBLE
+			afile.channels = le_uint(b + 2, 2);
+			*sample_rate = le_uint(b + 4, 4);
+			afile.bytes = le_uint(b + 14, 2) / 8;
+			afile.is_float = tag == 3;
+			if((tag != 1 && tag != 3) || (afile.is_float && afile.bytes != 4) ||
+					afile.bytes < 2 || afile.bytes > 4)
+				return 1;
+			fmt_found = 1;
+			if(fseek(f, size - n + (size & 1), SEEK_CUR))
+				return -1;
+		} else if(fseek(f, size + (size & 1), SEEK_CUR))
+			return -1;
+	}
+}
+
+/** Use an audio file as input.
+ *
+ * The samples of the file are fed to the same buffer as the sound card
+ * samples, by read_file_input(), as fast as the caller wants.  Timestamps
+ * count the frames read from the file.  WAV files (16, 24 or 32 bit integer
+ * or 32 bit float samples) are recognized from their header, other files are
+ * read as raw little-endian samples in the format described by raw.
+ *
+ * @param filename The file to open.
+ * @param raw Format of raw files, NULL to accept only WAV files.
+ * @param int16 Keep 16 bit samples in the buffers, as in start_portaudio().
+ * @param[out] nominal_sample_rate The sample rate of the file.
+ * @param[out] real_sample_rate The same.
+ * @param[in,out] channels As in start_portaudio().
+ * @returns 0 on success, 1 on failure.
+ */
+int start_file_input(char *filename, struct raw_format *raw, int int16, int *nominal_sample_rate, double *real_sample_rate, int *channels)
+{
+	int sample_rate;
+
+	afile.f = fopen(filename, "rb");
+	if(!afile.f) {
+		error("Can not open %s", filename);
+		return 1;
+	}
+	int wav = open_wav(afile.f, &sample_rate);
+	if(wav > 0) {
+		error("Unsupported WAV sample format in %s", filename);
+		goto error;
+	}
+	if(wav < 0) {
+		if(!raw) {
+			error("%s is not a valid WAV file", filename);
+			goto error;
+		}
+		rewind(afile.f);
+		afile.channels = raw->channels;
+		afile.bytes = raw->is_float ? 4 : 2;
+		afile.is_float = raw->is_float;
+		afile.data_left = UINT64_MAX;
+		sample_rate = raw->sample_rate;
+	}
+	if(afile.channels < 1) {
+		error("Invalid channel count in %s", filename);
+		goto error;
+	}
+	if(sample_rate < MIN_SAMPLE_RATE || sample_rate > MAX_SAMPLE_RATE) {
+		error("Unsupported sample rate %d in %s", sample_rate, filename);
+		goto error;
+	}
+
+	if(*channels) {
+		info.channels = MIN(afile.channels, MAX_CHANNELS);
+		*channels = info.channels;
+	} else {
+		info.channels = MIN(afile.channels, 2);
+		*channels = 1;
+	}
+	if(setup_rings(*channels, sample_rate, int16))
+		goto error;
+	info.input_int16 = false;
+	info.decimation = light_decimation(sample_rate);
+	info.light = false;
+	info.request_light = false;
+	info.next_adc_time = 0;
+	memset(&info.stats, 0, sizeof(info.stats));
+	info.realtime = false;
+	reset_position(false);
+
+	*nominal_sample_rate = sample_rate_in_use = sample_rate;
+	*real_sample_rate = sample_rate;
+	debug("file %s: %d Hz, %d channels, %d bytes %s\n", filename, sample_rate,
+			afile.channels, afile.bytes, afile.is_float ? "float" : "int");
+	return 0;
+
+error:
+	free_rings();
+	fclose(afile.f);
+	afile.f = NULL;
+	return 1;
+}
+
+/** Feed the next frames of the input file to the audio buffer.
+ *
+ * @param frames The number of frames to read.
+ * @returns The number of frames actually read, 0 at the end of the file.
+ */
+long read_file_input(long frames)
+{
+	unsigned char raw[4096];
+	/* n frames of afile.channels samples of at least a byte fill raw, and
+	 * at most info.channels <= afile.channels of them are kept */
+	float samples[sizeof(raw)];
+	const int frame_size = afile.channels * afile.bytes;
+	long done = 0;
+
+	while(done < frames && afile.data_left >= (uint64_t)frame_size) {
+		size_t n = MIN(sizeof(raw) / frame_size, (size_t)(frames - done));
+		n = MIN(n, afile.data_left / frame_size);
+		n = fread(raw, frame_size, n, afile.f);
+		if(!n) break;
+		size_t i;
+		int c;
+		for(i = 0; i < n; i++)
+			for(c = 0; c < info.channels; c++)
+				samples[i * info.channels + c] = decode_sample(raw + i * frame_size + c * afile.bytes);
+		paudio_callback(samples, NULL, n, NULL, 0, &info);
+		afile.data_left -= n * frame_size;
+		done += n;
+	}
+	return done;
+}
+
+void close_file_input()
+{
+	if(afile.f) fclose(afile.f);
+	afile.f = NULL;
+	free_rings();
+}
+
 uint64_t get_timestamp(int light)
 {
-	pthread_mutex_lock(&audio_mutex);
-	uint64_t ts = light ? timestamp / 2 : timestamp;
-	pthread_mutex_unlock(&audio_mutex);
-	return ts;
+	struct ring_position pos;
+	read_position(&pos);
+	return pos.timestamp / get_decimation(light);
+}
+
+/** Decimation factor of the audio fed to the algorithm.
+ *
+ * @param light True for light mode, false for normal
+ * @returns The ratio between the input sample rate and the rate of the samples
+ * stored in the audio buffer.
+ */
+int get_decimation(int light)
+{
+	return light ? info.decimation : 1;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/** Estimate the clock error of the sound card.
+ *
+ * The slope of the points collected by track_drift() is estimated with the
+ * Theil-Sen method, that is the median of the slopes between pairs of points,
+ * which tolerates the points spoiled by a late callback.  Pairing each point of
+ * the older half with the point half the span later makes the slopes
+ * independent, and gives a confidence interval from their spread.
+ *
+ * @param[out] drift The deviation of the real sample rate from the nominal one
+ * in 0.1 s/d, positive if the sound card is fast, in the same unit as the
+ * calibration.
+ * @param[out] ci Half width of the 95% confidence interval of drift.
+ * @returns 1 if the estimate is available, 0 if there are not enough points.
+ */
+int get_clock_drift(double *drift, double *ci)
+{
+	unsigned count = __atomic_load_n(&drift_count, __ATOMIC_ACQUIRE);
+	unsigned first = __atomic_load_n(&drift_first, __ATOMIC_ACQUIRE);
+	unsigned n = MIN(count - first, DRIFT_POINTS - 1);
+	if(n < DRIFT_MIN_POINTS || !sample_rate_in_use) return 0;
+
+	unsigned i, h = n / 2;
+	double *slopes = malloc(h * sizeof(double));
+	for(i = 0; i < h; i++) {
+		const struct drift_point *a = &drift_points[(count - n + i) % DRIFT_POINTS];
+		const struct drift_point *b = &drift_points[(count - n + i + h) % DRIFT_POINTS];
+		/* Input frames per second */
+		slopes[i] = (b->frames - a->frames) * 1e6 / (b->time - a->time);
+	}
+	qsort(slopes, h, sizeof(double), compare_double);
+	double rate = h % 2 ? slopes[h/2] : (slopes[h/2 - 1] + slopes[h/2]) / 2;
+	for(i = 0; i < h; i++)
+		slopes[i] = fabs(slopes[i] - rate);
+	qsort(slopes, h, sizeof(double), compare_double);
+	double mad = slopes[h/2];
+	free(slopes);
+
+	/* Standard error of the median of normal samples, scaled to 95% */
+	double sigma = 1.4826 * mad * 1.2533 / sqrt(h);
+	*drift = (rate / sample_rate_in_use - 1) * 10 * 3600 * 24;
+	*ci = 1.96 * sigma / sample_rate_in_use * 10 * 3600 * 24;
+	return 1;
 }
 
-static void fill_buffers(struct processing_buffers *ps, int light)
+/** Counters of the input lost by the audio device since it was opened.
+ *
+ * @param[out] stats The counters.
+ */
+void get_audio_stats(struct audio_stats *stats)
 {
-	pthread_mutex_lock(&audio_mutex);
-	uint64_t ts = timestamp;
-	int wp = write_pointer;
-	pthread_mutex_unlock(&audio_mutex);
+	stats->overflows = __atomic_load_n(&info.stats.overflows, __ATOMIC_RELAXED);
+	stats->gaps = __atomic_load_n(&info.stats.gaps, __ATOMIC_RELAXED);
+	stats->lost_frames = __atomic_load_n(&info.stats.lost_frames, __ATOMIC_RELAXED);
+}
 
-	if(light)
-		ts /= 2;
+/** Describe the audio buffers to a reader other than the computers.
+ *
+ * The buffers stay valid until the audio input is closed, and the samples
+ * before v->frames until the writer overwrites them v->size samples later.
+ *
+ * @param[out] v The view.
+ */
+void get_audio_view(struct audio_view *v)
+{
+	struct ring_position pos;
+	read_position(&pos);
+	int i;
+	for(i = 0; i < info.rings; i++)
+		v->rings[i] = pa_buffers[i];
+	v->channels = info.rings;
+	v->int16 = info.int16;
+	v->scale = info.int16 ? 1 / info.store_scale : 1;
+	v->size = ring_size;
+	v->decimation = get_decimation(pos.light);
+	v->sample_rate = sample_rate_in_use / v->decimation;
+	v->resets = pos.resets;
+	v->frames = pos.frames;
+	v->timestamp = pos.timestamp;
+}
 
+/* Feed the front end of pd with the samples written since the last call, and
+ * point each step to its window of the envelope */
+static void fill_buffers(struct processing_data *pd, int suppress)
+{
+	struct processing_buffers *ps = pd->buffers;
+	struct front_end *fe = pd->front_end;
+	const char *buffer = pa_buffers[pd->channel];
+	struct ring_position pos;
+	read_position(&pos);
 	int i;
+
+	/* Samples written before the last reset, or before a gap in the
+	 * input, count as silence.  The front end also starts over when the
+	 * noise suppressor is switched, or if it is too far behind, from as far
+	 * back as its envelope goes. */
+	uint64_t start = last_discontinuity(&pos);
+	uint64_t span = fe->size + fe->delay;
+	if(suppress != fe->suppress || pos.resets != pd->resets ||
+			pd->frames < start || pos.frames - pd->frames > span) {
+		reset_front_end(fe, suppress);
+		/* The audio may come from another watch */
+		for(i = 0; i < NSTEPS; i++)
+			ps[i].tracker.locked = 0;
+		span = fe->size + fe->delay;
+		if(pos.frames - start > span)
+			start = pos.frames - span;
+	} else
+		start = pd->frames;
+
+	/* Any ring_size consecutive samples are contiguous */
+	while(start < pos.frames) {
+		unsigned n = MIN(pos.frames - start, ring_size);
+		const char *p = buffer + (start % ring_size) * sample_size;
+		if(info.int16)
+			run_front_end(fe, NULL, (const int16_t *)p, 1 / info.store_scale, n);
+		else
+			run_front_end(fe, (const float *)p, NULL, 1, n);
+		start += n;
+	}
+	pd->resets = pos.resets;
+	pd->frames = pos.frames;
+
+	uint64_t ts = pos.timestamp / get_decimation(pd->is_light);
+	ts -= MIN(ts, (uint64_t)fe->delay);
+
 	for(i = 0; i < NSTEPS; i++) {
 		ps[i].timestamp = ts;
-
-		int start = wp - ps[i].sample_count;
-		if (start < 0) start += PA_BUFF_SIZE;
-		int len = MIN((unsigned)ps[i].sample_count, PA_BUFF_SIZE - start);
-		memcpy(ps[i].samples, pa_buffers + start, len * sizeof(*pa_buffers));
-		if (len < ps[i].sample_count)
-			memcpy(ps[i].samples + len, pa_buffers, (ps[i].sample_count - len) * sizeof(*pa_buffers));
+		ps[i].envelope = front_end_window(fe, i, &ps[i].average);
+		ps[i].coarse = front_end_coarse(fe, i, &ps[i].sums);
 	}
 }
 
 int analyze_pa_data(struct processing_data *pd, int bph, double la, uint64_t events_from)
 {
 	struct processing_buffers *p = pd->buffers;
-	fill_buffers(p, pd->is_light);
+	fill_buffers(pd, !pd->is_light);
 
 	int i;
 	debug("\nSTART OF COMPUTATION CYCLE\n\n");
 	for(i=0; i<NSTEPS; i++) {
 		p[i].last_tic = pd->last_tic;
 		p[i].events_from = events_from;
-		process(&p[i], bph, la, pd->is_light);
+	}
+	if(pd->pool)
+		process_steps(pd->pool, p, bph, la);
+	for(i=0; i<NSTEPS; i++) {
+		if(!pd->pool)
+			process(&p[i], bph, la);
+		if(!bph)
+			update_tracker(&p[i]);
 		if( !p[i].ready ) break;
 		debug("step %d : %f +- %f\n",i,p[i].period/p[i].sample_rate,p[i].sigma/p[i].sample_rate);
 	}
+	/* The steps after a failed one are not used, nor tracked */
+	int j;
+	for(j = i + 1; j < NSTEPS; j++)
+		p[j].tracker.locked = 0;
 	if(i) {
 		pd->last_tic = p[i-1].last_tic;
 		debug("%f +- %f\n",p[i-1].period/p[i-1].sample_rate,p[i-1].sigma/p[i-1].sample_rate);
@@ -212,7 +991,7 @@ int analyze_pa_data(struct processing_data *pd, int bph, double la, uint64_t eve
 int analyze_pa_data_cal(struct processing_data *pd, struct calibration_data *cd)
 {
 	struct processing_buffers *p = pd->buffers;
-	fill_buffers(p, pd->is_light);
+	fill_buffers(pd, 0);
 
 	int i,j;
 	debug("\nSTART OF CALIBRATION CYCLE\n\n");
@@ -234,12 +1013,19 @@ int analyze_pa_data_cal(struct processing_data *pd, struct calibration_data *cd)
  */
 void set_audio_light(bool light)
 {
-	if(info.light != light) {
-		pthread_mutex_lock(&audio_mutex);
-		info.light = light;
-		memset(pa_buffers, 0, sizeof(pa_buffers));
-		write_pointer = 0;
-		timestamp = 0;
-		pthread_mutex_unlock(&audio_mutex);
+	if(info.request_light != light) {
+		__atomic_store_n(&info.reset_done, false, __ATOMIC_RELAXED);
+		__atomic_store_n(&info.request_light, light, __ATOMIC_RELEASE);
+		/* Without a running stream there is no callback to race with */
+		if(!stream || Pa_IsStreamActive(stream) != 1) {
+			apply_light_request(&info);
+			return;
+		}
+		/* Wait for the callback to switch, so that no stale timestamp is
+		 * seen after we return.  Give up after a few buffers if the stream
+		 * has stalled, the callback switches when it resumes. */
+		int i;
+		for(i = 0; i < LIGHT_SWITCH_WAIT && !__atomic_load_n(&info.reset_done, __ATOMIC_ACQUIRE); i++)
+			g_usleep(1000);
 	}
 }
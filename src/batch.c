@@ -0,0 +1,298 @@
+/*
+    tg
+    Copyright (C) 2015 Marcello Mamino
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "tg.h"
+#include <inttypes.h>
+
+/* Batch mode: analyze recordings, or monitor the sound card, without the
+ * GUI.  Every channel can be analyzed by its own computer, each one running
+ * in its own thread. */
+
+static int bph = 0;
+static double la = DEFAULT_LA;
+static int cal = 0;
+static gboolean auto_cal = FALSE;
+static gboolean light = FALSE;
+static gboolean separate = FALSE;
+static gboolean int16 = FALSE;
+static gboolean parallel = FALSE;
+static int duration = 0;
+static int rate = DEFAULT_SAMPLE_RATE;
+static int device = -1;
+static int raw_channels = 1;
+static gchar *raw_type = NULL;
+static gchar *journal_dir = NULL;
+
+static GOptionEntry entries[] = {
+	{ "bph", 'b', 0, G_OPTION_ARG_INT, &bph, "Beats per hour (default: guess)", "BPH" },
+	{ "lift-angle", 'l', 0, G_OPTION_ARG_DOUBLE, &la, "Lift angle in degrees", "DEG" },
+	{ "calibration", 'c', 0, G_OPTION_ARG_INT, &cal, "Calibration in 0.1 s/d", "CAL" },
+	{ "auto-calibration", 'a', 0, G_OPTION_ARG_NONE, &auto_cal, "Measure the calibration against the system clock while monitoring", NULL },
+	{ "light", 0, 0, G_OPTION_ARG_NONE, &light, "Use the light algorithm", NULL },
+	{ "separate", 's', 0, G_OPTION_ARG_NONE, &separate, "Analyze each input channel separately", NULL },
+	{ "int16", 0, 0, G_OPTION_ARG_NONE, &int16, "Keep 16 bit samples in memory instead of floats", NULL },
+	{ "parallel", 0, 0, G_OPTION_ARG_NONE, &parallel, "Analyze the steps of each cycle at the same time", NULL },
+	{ "duration", 'd', 0, G_OPTION_ARG_INT, &duration, "Stop monitoring after this many seconds", "SEC" },
+	{ "raw", 'r', 0, G_OPTION_ARG_STRING, &raw_type, "Read raw samples of type s16 or f32", "TYPE" },
+	{ "rate", 0, 0, G_OPTION_ARG_INT, &rate, "Sample rate of raw files and of the capture", "HZ" },
+	{ "device", 0, 0, G_OPTION_ARG_INT, &device, "Index of the capture device (default: system default)", "N" },
+	{ "channels", 0, 0, G_OPTION_ARG_INT, &raw_channels, "Channels of raw files", "N" },
+	{ "journal", 'j', 0, G_OPTION_ARG_FILENAME, &journal_dir, "Save the captured audio in this directory", "DIR" },
+	{ NULL }
+};
+
+struct batch {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int pending;
+	int count;
+	int nominal_sr;
+	struct computer *computers[MAX_CHANNELS];
+};
+
+static void computer_done(void *p)
+{
+	struct batch *b = p;
+	pthread_mutex_lock(&b->mutex);
+	b->pending--;
+	pthread_cond_signal(&b->cond);
+	pthread_mutex_unlock(&b->mutex);
+}
+
+/* Run one cycle of all the computers (or stop them if recompute < 0) */
+static void run_computers(struct batch *b, int recompute)
+{
+	int i;
+	pthread_mutex_lock(&b->mutex);
+	b->pending = b->count;
+	pthread_mutex_unlock(&b->mutex);
+
+	for(i = 0; i < b->count; i++) {
+		struct computer *c = b->computers[i];
+		lock_computer(c);
+		c->bph = bph;
+		c->la = la;
+		c->calibrate = 0;
+		c->recompute = recompute;
+		unlock_computer(c);
+	}
+
+	pthread_mutex_lock(&b->mutex);
+	while(b->pending)
+		pthread_cond_wait(&b->cond, &b->mutex);
+	pthread_mutex_unlock(&b->mutex);
+}
+
+static void stop_computers(struct batch *b)
+{
+	int i;
+	run_computers(b, -1);
+	for(i = 0; i < b->count; i++)
+		computer_destroy(b->computers[i]);
+	pthread_mutex_destroy(&b->mutex);
+	pthread_cond_destroy(&b->cond);
+}
+
+static int start_computers(struct batch *b, int channels, int nominal_sr)
+{
+	b->pending = 0;
+	b->count = 0;
+	b->nominal_sr = nominal_sr;
+	pthread_mutex_init(&b->mutex, NULL);
+	pthread_cond_init(&b->cond, NULL);
+	for(; b->count < channels; b->count++) {
+		struct computer *c = start_computer(nominal_sr, bph, la, cal, light, b->count, parallel);
+		if(!c) {
+			stop_computers(b);
+			return 1;
+		}
+		c->callback = computer_done;
+		c->callback_data = b;
+		b->computers[b->count] = c;
+	}
+	printf("# time\tchannel\tbph\trate\tbeat error\tamplitude\n");
+	return 0;
+}
+
+static void print_snapshot(struct snapshot *s, int channel)
+{
+	s->bph = bph;
+	s->la = la;
+	s->cal = cal;
+	s->auto_cal = auto_cal;
+	compute_results(s);
+	if(s->pb) {
+		printf("%.1f\t%d\t%d\t%+.1f\t%.1f\t", (double)s->pb->timestamp / s->nominal_sr,
+				channel, s->guessed_bph, s->rate, s->be);
+		if(s->amp > 0) printf("%.0f\n", s->amp);
+		else printf("-\n");
+	} else
+		printf("%.1f\t%d\t-\t-\t-\t-\n", (double)get_timestamp(s->is_light) / s->nominal_sr, channel);
+}
+
+static void print_results(struct batch *b)
+{
+	int i;
+	for(i = 0; i < b->count; i++) {
+		struct computer *c = b->computers[i];
+		lock_computer(c);
+		struct snapshot *s = c->curr;
+		c->curr = NULL;
+		unlock_computer(c);
+		if(s) {
+			print_snapshot(s, i);
+			snapshot_destroy(s);
+		}
+	}
+	fflush(stdout);
+}
+
+static int analyze_file(char *filename, struct raw_format *raw)
+{
+	int nominal_sr;
+	double real_sr;
+	int channels = separate ? MAX_CHANNELS : 0;
+	if(start_file_input(filename, raw, int16, &nominal_sr, &real_sr, &channels))
+		return 1;
+
+	struct batch b;
+	printf("# %s\n", filename);
+	if(start_computers(&b, channels, nominal_sr)) {
+		close_file_input();
+		return 1;
+	}
+
+	/* One computation every 100 ms of audio, like the GUI */
+	long step = nominal_sr / 10;
+	while(read_file_input(step) == step) {
+		run_computers(&b, 1);
+		print_results(&b);
+	}
+
+	stop_computers(&b);
+	close_file_input();
+	return 0;
+}
+
+static int monitor()
+{
+	int nominal_sr;
+	double real_sr;
+	int channels = separate ? MAX_CHANNELS : 0;
+	if(start_portaudio(device, rate, int16, &nominal_sr, &real_sr, &channels))
+		return 1;
+
+	struct batch b;
+	if(start_computers(&b, channels, nominal_sr)) {
+		terminate_portaudio();
+		return 1;
+	}
+
+	/* Monitoring lasts long enough to measure better FFT plans */
+	start_fft_planner();
+
+	struct journal *journal = NULL;
+	if(journal_dir) {
+		journal = start_journal(journal_dir);
+		if(!journal) {
+			stop_fft_planner();
+			stop_computers(&b);
+			terminate_portaudio();
+			return 1;
+		}
+	}
+
+	/* Compute every 100 ms like the GUI, print once a second */
+	int cycle;
+	unsigned gaps = 0;
+	for(cycle = 1; !duration || cycle <= 10 * duration; cycle++) {
+		g_usleep(100000);
+		run_computers(&b, 1);
+		if(cycle % 10 == 0) {
+			print_results(&b);
+			struct audio_stats stats;
+			get_audio_stats(&stats);
+			double drift, ci;
+			if(auto_cal && get_clock_drift(&drift, &ci))
+				printf("# calibration: %+.1f +- %.1f s/d\n", drift / 10, ci / 10);
+			if(stats.gaps != gaps) {
+				printf("# input lost: %u overflows, %u gaps, %" PRIu64 " frames\n",
+						stats.overflows, stats.gaps, stats.lost_frames);
+				gaps = stats.gaps;
+			}
+		}
+	}
+
+	stop_journal(journal);
+	stop_fft_planner();
+	stop_computers(&b);
+	terminate_portaudio();
+	return 0;
+}
+
+/** Entry point of the batch mode.
+ *
+ * In "analyze" mode, analyzes the audio files given on the command line and
+ * prints on stdout the results of every computation cycle.  In "monitor" mode,
+ * prints once a second the readings from the default audio device.
+ *
+ * @param argc Argument count, argv[0] is the name of the mode.
+ * @param argv Arguments.
+ * @returns The exit status.
+ */
+int batch_main(int argc, char **argv)
+{
+	int analyze = !strcmp(argv[0], "analyze");
+	GError *e = NULL;
+	GOptionContext *context = g_option_context_new(analyze ?
+			"FILE... - analyze recordings" : "- monitor the audio input");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if(!g_option_context_parse(context, &argc, &argv, &e)) {
+		fprintf(stderr, "%s\n", e->message);
+		g_error_free(e);
+		g_option_context_free(context);
+		return 1;
+	}
+	g_option_context_free(context);
+
+	if(bph && (bph < MIN_BPH || bph > MAX_BPH)) {
+		fprintf(stderr, "Invalid bph %d\n", bph);
+		return 1;
+	}
+
+	load_fft_wisdom();
+	if(!analyze)
+		return monitor();
+
+	struct raw_format raw_format, *raw = NULL;
+	if(raw_type) {
+		if(strcmp(raw_type, "s16") && strcmp(raw_type, "f32")) {
+			fprintf(stderr, "Unknown raw sample type %s\n", raw_type);
+			return 1;
+		}
+		raw_format.sample_rate = rate;
+		raw_format.channels = raw_channels;
+		raw_format.is_float = !strcmp(raw_type, "f32");
+		raw = &raw_format;
+	}
+
+	int i, ret = 0;
+	for(i = 1; i < argc; i++)
+		ret |= analyze_file(argv[i], raw);
+	return ret;
+}
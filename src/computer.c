@@ -146,7 +146,8 @@ static void compute_events(struct computer *c)
 
 void compute_results(struct snapshot *s)
 {
-	s->sample_rate = s->nominal_sr * (1 + (double) s->cal / (10 * 3600 * 24));
+	double cal = s->auto_cal && s->drift_valid ? s->drift : s->cal;
+	s->sample_rate = s->nominal_sr * (1 + cal / (10 * 3600 * 24));
 	if(s->pb) {
 		s->guessed_bph = s->bph ? s->bph : guess_bph(s->pb->period / s->sample_rate);
 		s->rate = (7200/(s->guessed_bph * s->pb->period / s->sample_rate) - 1)*24*3600;
@@ -158,6 +159,117 @@ void compute_results(struct snapshot *s)
 		s->guessed_bph = s->bph ? s->bph : DEFAULT_BPH;
 }
 
+/* Threads that run the steps of a computation cycle at the same time, see
+ * process_steps() */
+struct step_pool {
+	pthread_t threads[NSTEPS - 1];
+	int count;
+	pthread_mutex_t mutex;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct processing_buffers *buffers;
+	int bph;
+	double la;
+	int next;	//!< Next step to run, -1 if none
+	int running;	//!< Steps being run
+	int quit;
+};
+
+/* Run the next step, called with the mutex held */
+static void run_next_step(struct step_pool *sp)
+{
+	int i = sp->next--;
+	sp->running++;
+	pthread_mutex_unlock(&sp->mutex);
+	process(&sp->buffers[i], sp->bph, sp->la);
+	pthread_mutex_lock(&sp->mutex);
+	if(!--sp->running && sp->next < 0)
+		pthread_cond_signal(&sp->done);
+}
+
+static void *step_thread(void *void_pool)
+{
+	struct step_pool *sp = void_pool;
+	pthread_mutex_lock(&sp->mutex);
+	for(;;) {
+		while(sp->next < 0 && !sp->quit)
+			pthread_cond_wait(&sp->work, &sp->mutex);
+		if(sp->quit) break;
+		run_next_step(sp);
+	}
+	pthread_mutex_unlock(&sp->mutex);
+	return NULL;
+}
+
+/* Start one thread less than the steps, or than the processors, since the
+ * caller of process_steps() runs steps too.  Returns NULL if there is only
+ * one processor. */
+static struct step_pool *start_step_pool()
+{
+	int count = MIN(NSTEPS, (int)g_get_num_processors()) - 1;
+	if(count < 1) return NULL;
+
+	struct step_pool *sp = malloc(sizeof(struct step_pool));
+	sp->next = -1;
+	sp->running = 0;
+	sp->quit = 0;
+	if(    pthread_mutex_init(&sp->mutex, NULL)
+	    || pthread_cond_init(&sp->work, NULL)
+	    || pthread_cond_init(&sp->done, NULL)) {
+		free(sp);
+		return NULL;
+	}
+	for(sp->count = 0; sp->count < count; sp->count++)
+		if(pthread_create(&sp->threads[sp->count], NULL, step_thread, sp))
+			break;
+	debug("Started %d step threads\n", sp->count);
+	return sp;
+}
+
+static void step_pool_destroy(struct step_pool *sp)
+{
+	int i;
+	pthread_mutex_lock(&sp->mutex);
+	sp->quit = 1;
+	pthread_cond_broadcast(&sp->work);
+	pthread_mutex_unlock(&sp->mutex);
+	for(i = 0; i < sp->count; i++)
+		pthread_join(sp->threads[i], NULL);
+	pthread_mutex_destroy(&sp->mutex);
+	pthread_cond_destroy(&sp->work);
+	pthread_cond_destroy(&sp->done);
+	free(sp);
+}
+
+/** Run process() on all the steps at the same time.
+ *
+ * The steps do not depend on each other, so the results up to the first one
+ * that is not ready, which are the ones the callers look at, are the same as
+ * running them one after another.  The steps after it are run anyway, and
+ * their results ignored.  The largest steps start first, so that the cycle
+ * takes about as long as the largest step.  Each step needs its own scratch
+ * space, see setup_scratch().
+ *
+ * @param sp The threads of the computer
+ * @param p The NSTEPS processing buffers
+ * @param bph The bph to look for, or 0 to guess
+ * @param la The lift angle
+ */
+void process_steps(struct step_pool *sp, struct processing_buffers *p, int bph, double la)
+{
+	pthread_mutex_lock(&sp->mutex);
+	sp->buffers = p;
+	sp->bph = bph;
+	sp->la = la;
+	sp->next = NSTEPS - 1;
+	pthread_cond_broadcast(&sp->work);
+	while(sp->next >= 0)
+		run_next_step(sp);
+	while(sp->running)
+		pthread_cond_wait(&sp->done, &sp->mutex);
+	pthread_mutex_unlock(&sp->mutex);
+}
+
 static void *computing_thread(void *void_computer)
 {
 	struct computer *c = void_computer;
@@ -195,6 +307,7 @@ static void *computing_thread(void *void_computer)
 			compute_update(c);
 			compute_events(c);
 		}
+		c->actv->drift_valid = get_clock_drift(&c->actv->drift, &c->actv->drift_ci);
 
 		pthread_mutex_lock(&c->mutex);
 			if(c->curr)
@@ -218,9 +331,15 @@ static void *computing_thread(void *void_computer)
 void computer_destroy(struct computer *c)
 {
 	int i;
-	for(i=0; i<NSTEPS; i++)
+	if(c->pdata->pool)
+		step_pool_destroy(c->pdata->pool);
+	for(i=0; i<NSTEPS; i++) {
 		pb_destroy(&c->pdata->buffers[i]);
+		scratch_destroy(c->pdata->scratch[i]);
+	}
 	free(c->pdata->buffers);
+	front_end_destroy(c->pdata->front_end);
+	free(c->pdata->front_end);
 	free(c->pdata);
 	cal_data_destroy(c->cdata);
 	free(c->cdata);
@@ -233,24 +352,42 @@ void computer_destroy(struct computer *c)
 	free(c);
 }
 
-struct computer *start_computer(int nominal_sr, int bph, double la, int cal, int light)
+struct computer *start_computer(int nominal_sr, int bph, double la, int cal, int light, int channel, int parallel)
 {
-	if(light) nominal_sr /= 2;
+	nominal_sr /= get_decimation(light);
 	set_audio_light(light);
 
 	struct processing_buffers *p = malloc(NSTEPS * sizeof(struct processing_buffers));
 	int first_step = light ? FIRST_STEP_LIGHT : FIRST_STEP;
-	int i;
+	int i, counts[NSTEPS];
+	for(i=0; i<NSTEPS; i++)
+		counts[i] = nominal_sr * (1<<(i+first_step));
+
+	struct processing_data *pd = malloc(sizeof(struct processing_data));
+	/* The buffers are sized for the decimation and the segments that the
+	 * front end chooses */
+	pd->front_end = malloc(sizeof(struct front_end));
+	setup_front_end(pd->front_end, nominal_sr, counts);
 	for(i=0; i<NSTEPS; i++) {
 		p[i].sample_rate = nominal_sr;
-		p[i].sample_count = nominal_sr * (1<<(i+first_step));
+		p[i].sample_count = counts[i];
+		p[i].decimation = pd->front_end->decimation;
+		p[i].segment = pd->front_end->segment;
 		setup_buffers(&p[i]);
 	}
-
-	struct processing_data *pd = malloc(sizeof(struct processing_data));
 	pd->buffers = p;
+	pd->pool = parallel ? start_step_pool() : NULL;
+	memset(pd->scratch, 0, sizeof(pd->scratch));
+	if(pd->pool)
+		for(i=0; i<NSTEPS; i++)
+			pd->scratch[i] = setup_scratch(&p[i], 1);
+	else
+		pd->scratch[0] = setup_scratch(p, NSTEPS);
+	pd->resets = 0;
+	pd->frames = 0;
 	pd->last_tic = 0;
 	pd->is_light = light;
+	pd->channel = channel;
 
 	struct calibration_data *cd = malloc(sizeof(struct calibration_data));
 	setup_cal_data(cd);
@@ -271,6 +408,10 @@ struct computer *start_computer(int nominal_sr, int bph, double la, int cal, int
 	s->bph = bph;
 	s->la = la;
 	s->cal = cal;
+	s->auto_cal = 0;
+	s->drift_valid = 0;
+	s->drift = 0;
+	s->drift_ci = 0;
 	s->is_light = light;
 
 	struct computer *c = malloc(sizeof(struct computer));
@@ -281,6 +422,7 @@ struct computer *start_computer(int nominal_sr, int bph, double la, int cal, int
 	c->recompute = 0;
 	c->calibrate = 0;
 	c->clear_trace = 0;
+	c->parallel = parallel;
 
 	if(    pthread_mutex_init(&c->mutex, NULL)
 	    || pthread_cond_init(&c->cond, NULL)
@@ -22,12 +22,16 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <ctype.h>
+#include <time.h>
 
 #ifdef DEBUG
 int testing = 0;
 #endif
 
 int preset_bph[] = PRESET_BPH;
+int sample_rates[] = SAMPLE_RATES;
+
+static int headless = 0;
 
 void print_debug(char *format,...)
 {
@@ -58,6 +62,8 @@ void error(char *format,...)
 
 	fprintf(stderr,"%s\n",t);
 
+	if(headless) return;
+
 #ifdef DEBUG
 	if(testing) return;
 #endif
@@ -72,6 +78,7 @@ static void refresh_results(struct main_window *w)
 	w->active_snapshot->bph = w->bph;
 	w->active_snapshot->la = w->la;
 	w->active_snapshot->cal = w->cal;
+	w->active_snapshot->auto_cal = w->auto_cal;
 	compute_results(w->active_snapshot);
 }
 
@@ -146,18 +153,54 @@ static void on_shutdown(GApplication *app, void *p)
 	debug("Main loop has terminated\n");
 	struct main_window *w = g_object_get_data(G_OBJECT(app), "main-window");
 	if(w) {
+		stop_journal(w->journal);
 		save_config(w);
 		computer_destroy(w->computer);
 		op_destroy(w->active_panel);
 		close_config(w);
 		free(w);
 	}
+	stop_fft_planner();
 	terminate_portaudio();
 }
 
 static void recompute(struct main_window *w);
 static void computer_callback(void *w);
 
+/* Open the audio input selected in w, or the default one if that fails */
+static int open_audio(struct main_window *w, double *real_sr)
+{
+	int channels = 0;
+	if(!start_portaudio(w->audio_device, w->sample_rate, w->int16_audio, &w->nominal_sr, real_sr, &channels))
+		return 0;
+	if(w->audio_device < 0 && w->sample_rate == DEFAULT_SAMPLE_RATE)
+		return 1;
+	w->audio_device = -1;
+	w->sample_rate = DEFAULT_SAMPLE_RATE;
+	channels = 0;
+	return start_portaudio(w->audio_device, w->sample_rate, w->int16_audio, &w->nominal_sr, real_sr, &channels);
+}
+
+/* Start or stop the journal of the audio input to match w->journal_enabled */
+static void update_journal(struct main_window *w)
+{
+	if(w->journal_enabled && !w->journal) {
+		char stamp[32];
+		time_t t = time(NULL);
+		strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&t));
+		char *dir = g_build_filename(g_get_user_data_dir(), PACKAGE, "journal", stamp, NULL);
+		w->journal = start_journal(dir);
+		g_free(dir);
+		if(!w->journal) {
+			w->journal_enabled = 0;
+			gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(w->journal_item), FALSE);
+		}
+	} else if(!w->journal_enabled && w->journal) {
+		stop_journal(w->journal);
+		w->journal = NULL;
+	}
+}
+
 static guint computer_terminated(struct main_window *w)
 {
 	if(w->zombie) {
@@ -166,7 +209,27 @@ static guint computer_terminated(struct main_window *w)
 	} else {
 		debug("Restarting computer");
 
-		struct computer *c = start_computer(w->nominal_sr, w->bph, w->la, w->cal, w->is_light);
+		if(w->restart_audio) {
+			double real_sr;
+			w->restart_audio = 0;
+			stop_journal(w->journal);
+			w->journal = NULL;
+			terminate_portaudio();
+			if(open_audio(w, &real_sr)) {
+				g_source_remove(w->kick_timeout);
+				g_source_remove(w->save_timeout);
+				w->zombie = 1;
+				gtk_widget_destroy(w->window);
+				return FALSE;
+			}
+			if(w->audio_device < 0)
+				gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(w->default_device_item), TRUE);
+			if(w->sample_rate == DEFAULT_SAMPLE_RATE)
+				gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(w->default_rate_item), TRUE);
+			update_journal(w);
+		}
+
+		struct computer *c = start_computer(w->nominal_sr, w->bph, w->la, w->cal, w->is_light, 0, w->parallel);
 		if(!c) {
 			g_source_remove(w->kick_timeout);
 			g_source_remove(w->save_timeout);
@@ -229,7 +292,7 @@ static void recompute(struct main_window *w)
 	w->computer_timeout = 0;
 	lock_computer(w->computer);
 	if(w->computer->recompute >= 0) {
-		if(w->is_light != w->computer->actv->is_light) {
+		if(w->is_light != w->computer->actv->is_light || w->parallel != w->computer->parallel || w->restart_audio) {
 			kill_computer(w);
 		} else {
 			w->computer->bph = w->bph;
@@ -270,6 +333,66 @@ static void handle_light(GtkCheckMenuItem *b, struct main_window *w)
 	}
 }
 
+static void handle_parallel(GtkCheckMenuItem *b, struct main_window *w)
+{
+	int button_state = gtk_check_menu_item_get_active(b) == TRUE;
+	if(button_state != w->parallel) {
+		w->parallel = button_state;
+		recompute(w);
+	}
+}
+
+static void handle_audio_device(GtkCheckMenuItem *b, struct main_window *w)
+{
+	int device = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(b), "audio-device"));
+	if(gtk_check_menu_item_get_active(b) && device != w->audio_device) {
+		w->audio_device = device;
+		w->restart_audio = 1;
+		recompute(w);
+	}
+}
+
+static void handle_sample_rate(GtkCheckMenuItem *b, struct main_window *w)
+{
+	int rate = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(b), "sample-rate"));
+	if(gtk_check_menu_item_get_active(b) && rate != w->sample_rate) {
+		w->sample_rate = rate;
+		w->restart_audio = 1;
+		recompute(w);
+	}
+}
+
+static void handle_int16_audio(GtkCheckMenuItem *b, struct main_window *w)
+{
+	int button_state = gtk_check_menu_item_get_active(b) == TRUE;
+	if(button_state != w->int16_audio) {
+		w->int16_audio = button_state;
+		w->restart_audio = 1;
+		recompute(w);
+	}
+}
+
+static void handle_auto_cal(GtkCheckMenuItem *b, struct main_window *w)
+{
+	int button_state = gtk_check_menu_item_get_active(b) == TRUE;
+	if(button_state != w->auto_cal) {
+		w->auto_cal = button_state;
+		if(!w->auto_cal)
+			gtk_widget_set_tooltip_text(w->cal_spin_button, NULL);
+		refresh_results(w);
+		gtk_widget_queue_draw(w->notebook);
+	}
+}
+
+static void handle_journal(GtkCheckMenuItem *b, struct main_window *w)
+{
+	int button_state = gtk_check_menu_item_get_active(b) == TRUE;
+	if(button_state != w->journal_enabled) {
+		w->journal_enabled = button_state;
+		update_journal(w);
+	}
+}
+
 static void controls_active(struct main_window *w, int active)
 {
 	w->controls_active = active;
@@ -824,11 +947,71 @@ static void init_main_window(struct main_window *w)
 	g_signal_connect(light_checkbox, "toggled", G_CALLBACK(handle_light), w);
 	gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(light_checkbox), w->is_light);
 
+	// ... Parallel checkbox
+	GtkWidget *parallel_checkbox = gtk_check_menu_item_new_with_label("Parallel analysis");
+	gtk_menu_shell_append(GTK_MENU_SHELL(command_menu), parallel_checkbox);
+	g_signal_connect(parallel_checkbox, "toggled", G_CALLBACK(handle_parallel), w);
+	gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(parallel_checkbox), w->parallel);
+
 	// ... Calibrate checkbox
 	w->cal_button = gtk_check_menu_item_new_with_label("Calibrate");
 	gtk_menu_shell_append(GTK_MENU_SHELL(command_menu), w->cal_button);
 	g_signal_connect(w->cal_button, "toggled", G_CALLBACK(handle_calibrate), w);
 
+	// ... Automatic calibration checkbox
+	GtkWidget *auto_cal_item = gtk_check_menu_item_new_with_label("Automatic calibration");
+	gtk_menu_shell_append(GTK_MENU_SHELL(command_menu), auto_cal_item);
+	gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(auto_cal_item), w->auto_cal);
+	g_signal_connect(auto_cal_item, "toggled", G_CALLBACK(handle_auto_cal), w);
+
+	// ... Input device submenu
+	GtkWidget *device_item = gtk_menu_item_new_with_label("Input device");
+	gtk_menu_shell_append(GTK_MENU_SHELL(command_menu), device_item);
+	GtkWidget *device_menu = gtk_menu_new();
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM(device_item), device_menu);
+	GSList *group = NULL;
+	for(i = -1; i < audio_device_count(); i++) {
+		const char *name = i < 0 ? "Default" : audio_device_name(i);
+		if(!name) continue;
+		GtkWidget *item = gtk_radio_menu_item_new_with_label(group, name);
+		group = gtk_radio_menu_item_get_group(GTK_RADIO_MENU_ITEM(item));
+		gtk_menu_shell_append(GTK_MENU_SHELL(device_menu), item);
+		g_object_set_data(G_OBJECT(item), "audio-device", GINT_TO_POINTER(i));
+		if(i < 0) w->default_device_item = item;
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item), i == w->audio_device);
+		g_signal_connect(item, "toggled", G_CALLBACK(handle_audio_device), w);
+	}
+
+	// ... Sample rate submenu
+	GtkWidget *rate_item = gtk_menu_item_new_with_label("Sample rate");
+	gtk_menu_shell_append(GTK_MENU_SHELL(command_menu), rate_item);
+	GtkWidget *rate_menu = gtk_menu_new();
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM(rate_item), rate_menu);
+	group = NULL;
+	for(i = 0; sample_rates[i]; i++) {
+		char s[32];
+		sprintf(s, "%.2f kHz", sample_rates[i] / 1000.);
+		GtkWidget *item = gtk_radio_menu_item_new_with_label(group, s);
+		group = gtk_radio_menu_item_get_group(GTK_RADIO_MENU_ITEM(item));
+		gtk_menu_shell_append(GTK_MENU_SHELL(rate_menu), item);
+		g_object_set_data(G_OBJECT(item), "sample-rate", GINT_TO_POINTER(sample_rates[i]));
+		if(sample_rates[i] == DEFAULT_SAMPLE_RATE) w->default_rate_item = item;
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item), sample_rates[i] == w->sample_rate);
+		g_signal_connect(item, "toggled", G_CALLBACK(handle_sample_rate), w);
+	}
+
+	// ... 16 bit buffers checkbox
+	GtkWidget *int16_item = gtk_check_menu_item_new_with_label("16 bit audio buffers");
+	gtk_menu_shell_append(GTK_MENU_SHELL(command_menu), int16_item);
+	gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(int16_item), w->int16_audio);
+	g_signal_connect(int16_item, "toggled", G_CALLBACK(handle_int16_audio), w);
+
+	// ... Journal checkbox
+	w->journal_item = gtk_check_menu_item_new_with_label("Record audio journal");
+	gtk_menu_shell_append(GTK_MENU_SHELL(command_menu), w->journal_item);
+	gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(w->journal_item), w->journal_enabled);
+	g_signal_connect(w->journal_item, "toggled", G_CALLBACK(handle_journal), w);
+
 	gtk_menu_shell_append(GTK_MENU_SHELL(command_menu), gtk_separator_menu_item_new());
 
 	// ... Close all
@@ -886,6 +1069,16 @@ guint refresh(struct main_window *w)
 			w->cal = s->cal_result;
 			gtk_spin_button_set_value(GTK_SPIN_BUTTON(w->cal_spin_button), s->cal_result);
 		}
+		if(w->auto_cal && s->drift_valid) {
+			int cal = round(s->drift);
+			if(cal >= MIN_CAL && cal <= MAX_CAL && cal != w->cal) {
+				w->cal = cal;
+				gtk_spin_button_set_value(GTK_SPIN_BUTTON(w->cal_spin_button), cal);
+			}
+			char tip[50];
+			sprintf(tip, "Measured: %+.2f +/- %.2f s/d", s->drift / 10, s->drift_ci / 10);
+			gtk_widget_set_tooltip_text(w->cal_spin_button, tip);
+		}
 	}
 	unlock_computer(w->computer);
 	refresh_results(w);
@@ -912,16 +1105,12 @@ static void start_interface(GApplication* app, void *p)
 {
 	UNUSED(p);
 	double real_sr;
+	int i;
 
 	initialize_palette();
 
 	struct main_window *w = malloc(sizeof(struct main_window));
 
-	if(start_portaudio(&w->nominal_sr, &real_sr)) {
-		g_application_quit(app);
-		return;
-	}
-
 	w->app = GTK_APPLICATION(app);
 
 	w->zombie = 0;
@@ -931,9 +1120,25 @@ static void start_interface(GApplication* app, void *p)
 	w->la = DEFAULT_LA;
 	w->calibrate = 0;
 	w->is_light = 0;
+	w->audio_device = -1;
+	w->sample_rate = DEFAULT_SAMPLE_RATE;
+	w->restart_audio = 0;
+	w->journal_enabled = 0;
+	w->int16_audio = 0;
+	w->parallel = 0;
+	w->journal = NULL;
+	w->auto_cal = 0;
 
 	load_config(w);
 
+	for(i = 0; sample_rates[i] && sample_rates[i] != w->sample_rate; i++);
+	if(!sample_rates[i]) w->sample_rate = DEFAULT_SAMPLE_RATE;
+
+	if(open_audio(w, &real_sr)) {
+		g_application_quit(app);
+		return;
+	}
+
 	if(w->la < MIN_LA || w->la > MAX_LA) w->la = DEFAULT_LA;
 	if(w->bph < MIN_BPH || w->bph > MAX_BPH) w->bph = 0;
 	if(w->cal < MIN_CAL || w->cal > MAX_CAL)
@@ -941,7 +1146,8 @@ static void start_interface(GApplication* app, void *p)
 
 	w->computer_timeout = 0;
 
-	w->computer = start_computer(w->nominal_sr, w->bph, w->la, w->cal, w->is_light);
+	load_fft_wisdom();
+	w->computer = start_computer(w->nominal_sr, w->bph, w->la, w->cal, w->is_light, 0, w->parallel);
 	if(!w->computer) {
 		error("Error starting computation thread");
 		g_application_quit(app);
@@ -957,6 +1163,8 @@ static void start_interface(GApplication* app, void *p)
 	w->active_panel = init_output_panel(w->computer, w->active_snapshot, 0);
 
 	init_main_window(w);
+	update_journal(w);
+	start_fft_planner();
 
 	w->kick_timeout = g_timeout_add_full(G_PRIORITY_LOW,100,(GSourceFunc)kick_computer,w,NULL);
 	w->save_timeout = g_timeout_add_full(G_PRIORITY_LOW,10000,(GSourceFunc)save_on_change_timer,w,NULL);
@@ -1001,11 +1209,22 @@ int main(int argc, char **argv)
 
 #ifdef DEBUG
 	if(argc > 1 && !strcmp("test",argv[1])) {
+		if(test_algorithms())
+			return 1;
 		testing = 1;
 		argv++; argc--;
 	}
+	if(argc > 1 && !strcmp("bench",argv[1])) {
+		benchmark_filters();
+		return 0;
+	}
 #endif
 
+	if(argc > 1 && (!strcmp("analyze",argv[1]) || !strcmp("monitor",argv[1]))) {
+		headless = 1;
+		return batch_main(argc - 1, argv + 1);
+	}
+
 	GtkApplication *app = gtk_application_new ("li.ciovil.tg", G_APPLICATION_HANDLES_OPEN);
 	g_signal_connect (app, "startup", G_CALLBACK (start_interface), NULL);
 	g_signal_connect (app, "activate", G_CALLBACK (handle_activate), NULL);
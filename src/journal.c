@@ -0,0 +1,303 @@
+/*
+    tg
+    Copyright (C) 2015 Marcello Mamino
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "tg.h"
+#include <inttypes.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* The journal saves the audio buffers to disk as they fill, so that a timing
+ * session can be audited, or analyzed again, later.  A thread polls the
+ * position of the audio writer and copies the new samples, so the audio
+ * callback never waits for the disk.
+ *
+ * The samples are stored as in the audio buffers, raw native float or int16,
+ * the channels interleaved, in segments of at most JOURNAL_SEGMENT_SIZE bytes
+ * named segment-NNNNNN.raw.  The text file index.txt has a line for each run
+ * of contiguous samples:
+ *
+ *	segment offset timestamp sample_rate channels wall_clock format
+ *
+ * offset counts frames from the start of the segment, timestamp is the first
+ * frame of the run in input frames since the journal was started, wall_clock
+ * is when the run was started in microseconds since the epoch, format is f32
+ * or s16 (full scale is the sum of two channels when they are mixed).  A new run
+ * starts with each segment, when the light algorithm changes the rate of the
+ * audio buffers, and after samples are lost because the disk was too slow.
+ */
+
+struct journal {
+	char	*dir;
+	FILE	*index;
+	pthread_t thread;
+	bool	stop;
+	int	channels;
+	int	frame_size;	//!< Bytes per frame
+	unsigned segment;	//!< Number of the open segment
+	size_t	used;		//!< Bytes written to the open segment
+#ifdef _WIN32
+	FILE	*f;
+	char	*chunk;
+#else
+	int	fd;
+	char	*map;
+#endif
+	bool	is_open;	//!< A segment is open
+	bool	new_run;	//!< The next samples start a new run
+	unsigned resets;	//!< Generation of the audio buffers being saved
+	uint64_t frames;	//!< Samples of this generation already saved
+	int64_t	origin;		//!< Journal time of the start of this generation
+	uint64_t last_timestamp;
+};
+
+static char *segment_name(struct journal *j)
+{
+	char name[32];
+	sprintf(name, "segment-%06u.raw", j->segment);
+	return g_build_filename(j->dir, name, NULL);
+}
+
+static void copy_frames(void *out, const struct audio_view *v, unsigned start, unsigned n)
+{
+	int c;
+	unsigned i;
+	for(c = 0; c < v->channels; c++) {
+		if(v->int16) {
+			const int16_t *in = (const int16_t *)v->rings[c] + start;
+			int16_t *o = out;
+			for(i = 0; i < n; i++)
+				o[i * v->channels + c] = in[i];
+		} else {
+			const float *in = (const float *)v->rings[c] + start;
+			float *o = out;
+			for(i = 0; i < n; i++)
+				o[i * v->channels + c] = in[i];
+		}
+	}
+}
+
+#ifdef _WIN32
+static int open_segment(struct journal *j)
+{
+	char *name = segment_name(j);
+	j->f = fopen(name, "wb");
+	g_free(name);
+	return !j->f;
+}
+
+static void write_frames(struct journal *j, const struct audio_view *v, unsigned start, unsigned n)
+{
+	while(n) {
+		unsigned m = MIN(n, JOURNAL_CHUNK);
+		copy_frames(j->chunk, v, start, m);
+		fwrite(j->chunk, j->frame_size, m, j->f);
+		start += m;
+		n -= m;
+	}
+}
+
+static void close_segment(struct journal *j)
+{
+	fclose(j->f);
+}
+#else
+static int open_segment(struct journal *j)
+{
+	char *name = segment_name(j);
+	j->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	g_free(name);
+	if(j->fd < 0) return 1;
+#ifdef HAVE_POSIX_FALLOCATE
+	/* Fail now rather than with SIGBUS when the disk is full */
+	if(posix_fallocate(j->fd, 0, JOURNAL_SEGMENT_SIZE)) goto error;
+#else
+	if(ftruncate(j->fd, JOURNAL_SEGMENT_SIZE)) goto error;
+#endif
+	j->map = mmap(NULL, JOURNAL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, j->fd, 0);
+	if(j->map == MAP_FAILED) goto error;
+	return 0;
+
+error:
+	close(j->fd);
+	return 1;
+}
+
+static void write_frames(struct journal *j, const struct audio_view *v, unsigned start, unsigned n)
+{
+	copy_frames(j->map + j->used, v, start, n);
+}
+
+static void close_segment(struct journal *j)
+{
+	munmap(j->map, JOURNAL_SEGMENT_SIZE);
+	if(ftruncate(j->fd, j->used))
+		debug("journal: failed to truncate segment %u\n", j->segment);
+	close(j->fd);
+}
+#endif
+
+static int next_segment(struct journal *j)
+{
+	if(j->is_open) {
+		close_segment(j);
+		j->segment++;
+	}
+	j->used = 0;
+	j->is_open = !open_segment(j);
+	j->new_run = true;
+	return !j->is_open;
+}
+
+/* Copy to disk everything written to the audio buffers since the last call.
+ * Returns 1 if the journal can not continue. */
+static int drain(struct journal *j)
+{
+	struct audio_view v;
+	get_audio_view(&v);
+
+	if(v.resets != j->resets) {
+		/* The samples between the last call and the reset are lost */
+		j->origin += j->last_timestamp;
+		j->resets = v.resets;
+		j->frames = 0;
+		j->new_run = true;
+	}
+	j->last_timestamp = v.timestamp;
+
+	/* Stay clear of the samples that the writer is about to overwrite */
+	uint64_t avail = v.frames - j->frames;
+	uint64_t safe = v.size - MIN(v.size / 2, (unsigned)v.sample_rate);
+	if(avail > safe) {
+		debug("journal: lost %" PRIu64 " samples\n", avail - safe);
+		j->frames = v.frames - safe;
+		avail = safe;
+		j->new_run = true;
+	}
+
+	while(avail) {
+		if(!j->is_open || j->used + j->frame_size > JOURNAL_SEGMENT_SIZE)
+			if(next_segment(j))
+				return 1;
+		if(j->new_run) {
+			fprintf(j->index, "%u %zu %" PRId64 " %d %d %" PRId64 " %s\n",
+					j->segment, j->used / j->frame_size,
+					j->origin + (int64_t)(j->frames * v.decimation),
+					v.sample_rate, j->channels, (int64_t)g_get_real_time(),
+					v.int16 ? "s16" : "f32");
+			fflush(j->index);
+			j->new_run = false;
+		}
+		unsigned n = MIN(avail, (JOURNAL_SEGMENT_SIZE - j->used) / j->frame_size);
+		write_frames(j, &v, j->frames % v.size, n);
+		j->used += (size_t)n * j->frame_size;
+		j->frames += n;
+		avail -= n;
+	}
+	return 0;
+}
+
+static void *journal_thread(void *p)
+{
+	struct journal *j = p;
+	while(!__atomic_load_n(&j->stop, __ATOMIC_ACQUIRE)) {
+		if(drain(j)) {
+			debug("journal: can not write segment %u, stopping\n", j->segment);
+			return NULL;
+		}
+		g_usleep(JOURNAL_POLL_INTERVAL);
+	}
+	drain(j);
+	return NULL;
+}
+
+/** Start saving the audio input to a directory.
+ *
+ * The audio input must be running, and must not be restarted before
+ * stop_journal() is called.  Only the samples captured from now on are
+ * saved.
+ *
+ * @param dir The directory, created if needed.
+ * @returns The journal, NULL on failure.
+ */
+struct journal *start_journal(const char *dir)
+{
+	struct audio_view v;
+	get_audio_view(&v);
+
+	if(g_mkdir_with_parents(dir, 0755)) {
+		error("Can not create the journal directory %s", dir);
+		return NULL;
+	}
+
+	struct journal *j = calloc(1, sizeof(struct journal));
+	j->dir = g_strdup(dir);
+	j->channels = v.channels;
+	j->frame_size = v.channels * (v.int16 ? sizeof(int16_t) : sizeof(float));
+	j->resets = v.resets;
+	j->frames = v.frames;
+	j->origin = -(int64_t)v.timestamp;
+	j->last_timestamp = v.timestamp;
+#ifdef _WIN32
+	j->chunk = malloc(JOURNAL_CHUNK * j->frame_size);
+#endif
+
+	char *index_name = g_build_filename(dir, "index.txt", NULL);
+	j->index = fopen(index_name, "w");
+	g_free(index_name);
+	if(!j->index || next_segment(j)) {
+		error("Can not write the journal in %s", dir);
+		goto error;
+	}
+	if(pthread_create(&j->thread, NULL, journal_thread, j)) {
+		error("Unable to start the journal thread");
+		close_segment(j);
+		goto error;
+	}
+	debug("journal: saving to %s\n", dir);
+	return j;
+
+error:
+	if(j->index) fclose(j->index);
+#ifdef _WIN32
+	free(j->chunk);
+#endif
+	g_free(j->dir);
+	free(j);
+	return NULL;
+}
+
+/** Save what is left in the audio buffers and close the journal.
+ *
+ * @param j The journal, or NULL.
+ */
+void stop_journal(struct journal *j)
+{
+	if(!j) return;
+	__atomic_store_n(&j->stop, true, __ATOMIC_RELEASE);
+	pthread_join(j->thread, NULL);
+	if(j->is_open) close_segment(j);
+	fclose(j->index);
+#ifdef _WIN32
+	free(j->chunk);
+#endif
+	g_free(j->dir);
+	free(j);
+}
@@ -68,9 +68,14 @@ static void draw_graph(double a, double b, cairo_t *c, struct processing_buffers
 }
 
 #ifdef DEBUG
+/* Draw the trace of the autocorrelation from the lag a to the lag b, in
+ * samples of the audio.  The trace is at the rate of the decimated envelope,
+ * see prepare_data(). */
 static void draw_debug_graph(double a, double b, cairo_t *c, struct processing_buffers *p, GtkWidget *da)
 {
 	if(!p->debug) return;
+	a /= p->decimation;
+	b /= p->decimation;
 
 	GtkAllocation temp;
 	gtk_widget_get_allocation (da, &temp);
@@ -83,7 +88,7 @@ static void draw_debug_graph(double a, double b, cairo_t *c, struct processing_b
 	int ai = round(a);
 	int bi = 1+round(b);
 	if(ai < 0) ai = 0;
-	if(bi > p->sample_count) bi = p->sample_count;
+	if(bi > p->debug_size) bi = p->debug_size;
 	for(i=ai; i<bi; i++)
 		if(p->debug[i] > max)
 			max = p->debug[i];
@@ -93,7 +98,7 @@ static void draw_debug_graph(double a, double b, cairo_t *c, struct processing_b
 		if( round(a + i*(b-a)/width) != round(a + (i+1)*(b-a)/width) ) {
 			int j = round(a + i*(b-a)/width);
 			if(j < 0) j = 0;
-			if(j >= p->sample_count) j = p->sample_count-1;
+			if(j >= p->debug_size) j = p->debug_size-1;
 
 			int k = round((0.1+p->debug[j]/max)*0.8*height);
 
@@ -33,8 +33,10 @@
 #endif
 
 #define CONFIG_FILE_NAME "tg-timer.ini"
+#define WISDOM_FILE_NAME "tg-timer.wisdom"
 
 #define FILTER_CUTOFF 3000
+#define COARSE_MIN_RATE 11025 // Hz, see setup_front_end()
 
 #define CAL_DATA_SIZE 900
 
@@ -42,8 +44,32 @@
 #define FIRST_STEP_LIGHT 0
 
 #define NSTEPS 4
-#define PA_SAMPLE_RATE 44100u
-#define PA_BUFF_SIZE (PA_SAMPLE_RATE << (NSTEPS + FIRST_STEP))
+#define DEFAULT_SAMPLE_RATE 44100
+#define MIN_SAMPLE_RATE 22050
+#define MAX_SAMPLE_RATE 192000
+#define SAMPLE_RATES { 22050, 44100, 48000, 96000, 0 }
+#define LIGHT_MIN_SAMPLE_RATE 22050
+#define MAX_LIGHT_DECIMATION 8
+#define RING_SECONDS (1 << (NSTEPS + FIRST_STEP))
+#define MAX_CHANNELS 16
+#define MAX_GAPS 64
+#define MAX_ADC_JITTER 0.02 // s
+#define LIGHT_SWITCH_WAIT 100 // ms, see set_audio_light()
+#define DRIFT_BUCKET 1 // s
+#define DRIFT_POINTS 1024
+#define DRIFT_MIN_POINTS 60
+
+#define FRONT_END_CHUNK 4096
+#define FFT_PLAN_TIME_LIMIT 10 // s
+#define FFT_PLANNER_POLL 1000000 // us
+#define CORRELATION_SEGMENT 0.25 // s, at most
+#define TRACK_DRIFT 1e-4 // relative change of the period per cycle
+#define TRACK_GATE 3 // standard deviations
+#define TRACK_CHECK 10 // cycles
+
+#define JOURNAL_SEGMENT_SIZE (64 << 20) // bytes
+#define JOURNAL_POLL_INTERVAL 100000 // us
+#define JOURNAL_CHUNK 4096 // frames
 
 #define OUTPUT_FONT 40
 #define OUTPUT_WINDOW_HEIGHT 70
@@ -77,13 +103,47 @@
 #define UNUSED(X) (void)(X)
 
 /* algo.c */
+/* Prediction of the period from the cycles before, see update_tracker() */
+struct period_tracker {
+	int	locked;		//!< The period is being tracked
+	int	cycles;		//!< Measures taken since the period was estimated from scratch
+	double	period;		//!< Predicted period, in samples
+	double	variance;	//!< Variance of the prediction
+};
+
+/* The autocorrelation of a window of the decimated envelope, kept by the front
+ * end a segment at a time, see front_end_coarse() */
+struct segment_sums {
+	const double *cross;	//!< Sums of the cross spectra of the pairs of full segments, by distance
+	const fftwf_complex *spectra; //!< Ring of the spectra of the segments
+	int	count;		//!< Size of spectra, in segments
+	int	stride;		//!< Complex values from a spectrum to the next
+	int	segments;	//!< Full segments seen since the reset
+	int	fill;		//!< Samples of the window past the last full segment
+};
+
 struct processing_buffers {
 	int sample_rate;
 	int sample_count;
-	float *samples, *samples_sc, *waveform, *waveform_sc, *tic_wf, *slice_wf, *tic_c;
-	fftwf_complex *fft, *sc_fft, *tic_fft, *slice_fft;
-	fftwf_plan plan_a, plan_b, plan_c, plan_d, plan_e, plan_f, plan_g;
-	struct filter *hpf, *lpf;
+	const float *envelope;	//!< Preprocessed audio, sample_count samples, see fill_buffers()
+	double average;		//!< Mean of envelope
+	const float *coarse;	//!< The envelope decimated, cut to whole segments, see front_end_coarse()
+	int decimation;		//!< Envelope samples per coarse sample
+	double coarse_average;	//!< Mean of coarse, see prepare_data()
+	struct segment_sums sums; //!< Of the segments of coarse
+	int segment;		//!< Samples of coarse per segment
+	int distances;		//!< Distances between segments in sums.cross
+	int edges;		//!< Segments at the edges of the taper, see prepare_data()
+	float *taper;		//!< Window applied to the edges of the envelope
+	int max_lag;		//!< Greatest lag of the autocorrelation that is read
+	int wf_fft_size;	//!< Waveform transform, at least 2 * sample_rate
+	int slice_size;		//!< Event correlation transform, at least sample_rate
+	float *waveform;
+	/* Scratch space shared by the steps, see setup_scratch() */
+	float *samples, *segment_c, *samples_sc, *waveform_sc, *tic_wf, *slice_wf, *tic_c;
+	fftwf_complex *sc_fft, *edge_fft, *tic_fft, *slice_fft;
+	double *cross_sum;
+	struct shared_plan *plan_a, *plan_b, *plan_c, *plan_d, *plan_e, *plan_f, *plan_g;
 	double period,sigma,be,waveform_max,phase,tic_pulse,toc_pulse,amp;
 	double cal_phase;
 	int waveform_max_i;
@@ -91,12 +151,74 @@ struct processing_buffers {
 	int ready;
 	uint64_t timestamp, last_tic, last_toc, events_from;
 	uint64_t *events;
+	struct period_tracker tracker;
 #ifdef DEBUG
 	int debug_size;
 	float *debug;
 #endif
 };
 
+#define HALFBAND_TAPS 47
+#define MAX_DECIMATION_STAGES 3
+
+struct halfband {
+	float delay[2 * HALFBAND_TAPS];
+	int pos;
+	int phase;
+};
+
+struct decimator {
+	int stages;
+	struct halfband hb[MAX_DECIMATION_STAGES];
+};
+
+/* Filters of the audio that run once per sample, see run_front_end() */
+struct front_end {
+	int	sample_rate;
+	int	size;		//!< Samples in the envelope ring
+	float	*envelope;	//!< Ring of size samples followed by a copy of itself
+	int	wp;		//!< Next write position in envelope
+	int	decimation;	//!< Envelope samples per coarse sample
+	float	*coarse;	//!< Ring of the envelope decimated, and a copy of it
+	int	coarse_size;	//!< Samples in the ring coarse
+	int	coarse_wp;	//!< Next write position in coarse
+	struct decimator decimator;
+	float	*chunk;		//!< Scratch space of window + FRONT_END_CHUNK samples
+	float	*rectified;	//!< Scratch space of FRONT_END_CHUNK samples
+	double	*energies;	//!< Scratch space of FRONT_END_CHUNK energies
+	struct filter *hpf, *lpf;
+	double	hpf_state[2], lpf_state[2];
+	int	counts[NSTEPS];	//!< Sizes of the windows of the steps
+	double	sums[NSTEPS];	//!< Sums of the windows, see front_end_window()
+	int	suppress;	//!< Run the noise suppressor, -1 before the first reset
+	int	delay;		//!< Samples of lag of the envelope behind the input
+
+	/* Noise suppressor */
+	int	window;		//!< Samples in the energy window
+	int	step;		//!< Samples in the blocks of the threshold
+	int	phase;		//!< Samples seen since the reset, modulo window
+	double	energy;		//!< Sum of the squares of the last window samples
+	double	block_max;	//!< Greatest energy in the current block
+	int	block_fill;	//!< Samples of the current block seen
+	float	*maxima;	//!< Greatest energy of the last blocks, a ring
+	float	*sorted;	//!< The same, in increasing order
+	int	max_blocks;	//!< Size of maxima
+	int	blocks;		//!< Blocks seen since the reset
+	double	threshold;	//!< Median of maxima
+
+	/* Autocorrelation of the decimated envelope, see add_segment() */
+	int	segment;	//!< Samples of coarse per segment
+	int	segment_fill;	//!< Samples of the current segment seen
+	int	segments;	//!< Segments seen since the reset
+	float	*segment_in;	//!< The current segment, followed by as many zeros
+	struct shared_plan *segment_plan;
+	fftwf_complex *spectra;	//!< Ring of the spectra of the last segments
+	int	spectra_count;	//!< Size of spectra, in segments
+	int	spectrum_stride; //!< Complex values from a spectrum to the next, for alignment
+	double	*cross[NSTEPS];	//!< Sums of the cross spectra of the pairs of segments of each window, by distance
+	int	distances[NSTEPS]; //!< Distances in cross
+};
+
 struct calibration_data {
 	int wp;
 	int size;
@@ -109,10 +231,28 @@ struct calibration_data {
 };
 
 void setup_buffers(struct processing_buffers *b);
+void *setup_scratch(struct processing_buffers *b, int count);
+void scratch_destroy(void *scratch);
 void pb_destroy(struct processing_buffers *b);
 struct processing_buffers *pb_clone(struct processing_buffers *p);
 void pb_destroy_clone(struct processing_buffers *p);
-void process(struct processing_buffers *p, int bph, double la, int light);
+void process(struct processing_buffers *p, int bph, double la);
+void update_tracker(struct processing_buffers *p);
+void load_fft_wisdom();
+void start_fft_planner();
+void stop_fft_planner();
+#ifdef DEBUG
+void benchmark_filters(void);
+int test_algorithms(void);
+#endif
+void setup_front_end(struct front_end *fe, int sample_rate, const int *counts);
+void front_end_destroy(struct front_end *fe);
+void reset_front_end(struct front_end *fe, int suppress);
+void run_front_end(struct front_end *fe, const float *in, const int16_t *in16, float scale, int count);
+const float *front_end_window(struct front_end *fe, int step, double *average);
+const float *front_end_coarse(struct front_end *fe, int step, struct segment_sums *sums);
+void setup_decimator(struct decimator *d, int factor);
+int decimate(struct decimator *d, float in, float *out);
 void setup_cal_data(struct calibration_data *cd);
 void cal_data_destroy(struct calibration_data *cd);
 int test_cal(struct processing_buffers *p);
@@ -121,13 +261,55 @@ int process_cal(struct processing_buffers *p, struct calibration_data *cd);
 /* audio.c */
 struct processing_data {
 	struct processing_buffers *buffers;
+	struct front_end *front_end;
+	void *scratch[NSTEPS];	//!< Of each buffer, or only the first shared by all
+	struct step_pool *pool;	//!< Runs the steps at the same time, or NULL
+	unsigned resets;	//!< Generation of the audio buffers fed to front_end
+	uint64_t frames;	//!< Samples of the audio buffers fed to front_end
 	uint64_t last_tic;
 	int is_light;
+	int channel;
+};
+
+struct raw_format {
+	int sample_rate;
+	int channels;
+	int is_float;
+};
+
+/* Read-only view of the audio buffers, see get_audio_view() */
+struct audio_view {
+	const void *rings[MAX_CHANNELS];
+	int	channels;	//!< Number of buffers
+	int	int16;		//!< The samples are int16, otherwise float
+	float	scale;		//!< Multiplier from the samples to float samples
+	unsigned size;		//!< Samples in each buffer
+	int	sample_rate;	//!< Rate of the buffered samples
+	int	decimation;	//!< Input frames per buffered sample
+	unsigned resets;	//!< Changes when the buffers restart from zero
+	uint64_t frames;	//!< Samples written since the last reset
+	uint64_t timestamp;	//!< Input frames delivered since the last reset
 };
 
-int start_portaudio(int *nominal_sample_rate, double *real_sample_rate);
+/* Input lost by the audio device, see get_audio_stats() */
+struct audio_stats {
+	unsigned overflows;	//!< Buffers flagged as overflowed by PortAudio
+	unsigned gaps;		//!< Discontinuities found in the input
+	uint64_t lost_frames;	//!< Input frames missing in the gaps
+};
+
+int start_portaudio(int device, int sample_rate, int int16, int *nominal_sample_rate, double *real_sample_rate, int *channels);
 int terminate_portaudio();
+int audio_device_count();
+const char *audio_device_name(int device);
+int start_file_input(char *filename, struct raw_format *raw, int int16, int *nominal_sample_rate, double *real_sample_rate, int *channels);
+long read_file_input(long frames);
+void close_file_input();
 uint64_t get_timestamp(int light);
+int get_decimation(int light);
+void get_audio_view(struct audio_view *v);
+void get_audio_stats(struct audio_stats *stats);
+int get_clock_drift(double *drift, double *ci);
 int analyze_pa_data(struct processing_data *pd, int bph, double la, uint64_t events_from);
 int analyze_pa_data_cal(struct processing_data *pd, struct calibration_data *cd);
 void set_audio_light(bool light);
@@ -144,6 +326,11 @@ struct snapshot {
 	int bph;
 	double la; // deg
 	int cal; // 0.1 s/d
+	int auto_cal; // use drift instead of cal
+
+	int drift_valid;
+	double drift; // 0.1 s/d, see get_clock_drift()
+	double drift_ci; // 0.1 s/d
 
 	int events_count;
 	uint64_t *events; // used in cal+timegrapher mode
@@ -182,6 +369,7 @@ struct computer {
 
 	struct processing_data *pdata;
 	struct calibration_data *cdata;
+	int parallel;	// run the steps at the same time, see process_steps()
 
 	struct snapshot *actv;
 	struct snapshot *curr;
@@ -190,7 +378,8 @@ struct computer {
 struct snapshot *snapshot_clone(struct snapshot *s);
 void snapshot_destroy(struct snapshot *s);
 void computer_destroy(struct computer *c);
-struct computer *start_computer(int nominal_sr, int bph, double la, int cal, int light);
+struct computer *start_computer(int nominal_sr, int bph, double la, int cal, int light, int channel, int parallel);
+void process_steps(struct step_pool *sp, struct processing_buffers *p, int bph, double la);
 void lock_computer(struct computer *c);
 void unlock_computer(struct computer *c);
 void compute_results(struct snapshot *s);
@@ -231,6 +420,9 @@ struct main_window {
 	GtkWidget *snapshot_name;
 	GtkWidget *snapshot_name_entry;
 	GtkWidget *cal_button;
+	GtkWidget *default_device_item;
+	GtkWidget *default_rate_item;
+	GtkWidget *journal_item;
 	GtkWidget *notebook;
 	GtkWidget *save_item;
 	GtkWidget *save_all_item;
@@ -248,7 +440,15 @@ struct main_window {
 	int bph;
 	double la; // deg
 	int cal; // 0.1 s/d
+	int auto_cal;
 	int nominal_sr;
+	int audio_device; // -1 = default
+	int sample_rate;
+	int restart_audio;
+	int journal_enabled;
+	int int16_audio;
+	int parallel;
+	struct journal *journal;
 
 	GKeyFile *config_file;
 	gchar *config_file_name;
@@ -259,6 +459,7 @@ struct main_window {
 };
 
 extern int preset_bph[];
+extern int sample_rates[];
 
 #ifdef DEBUG
 extern int testing;
@@ -272,7 +473,13 @@ void error(char *format,...);
 	OP(bph, bph, int) \
 	OP(lift_angle, la, double) \
 	OP(calibration, cal, int) \
-	OP(light_algorithm, is_light, int)
+	OP(light_algorithm, is_light, int) \
+	OP(audio_device, audio_device, int) \
+	OP(sample_rate, sample_rate, int) \
+	OP(journal, journal_enabled, int) \
+	OP(auto_calibration, auto_cal, int) \
+	OP(int16_audio, int16_audio, int) \
+	OP(parallel_analysis, parallel, int)
 
 struct conf_data {
 #define DEF(NAME,PLACE,TYPE) TYPE PLACE;
@@ -284,6 +491,13 @@ void save_config(struct main_window *w);
 void save_on_change(struct main_window *w);
 void close_config(struct main_window *w);
 
+/* journal.c */
+struct journal *start_journal(const char *dir);
+void stop_journal(struct journal *j);
+
+/* batch.c */
+int batch_main(int argc, char **argv);
+
 /* serializer.c */
 int write_file(FILE *f, struct snapshot **s, char **names, uint64_t cnt);
 int read_file(FILE *f, struct snapshot ***s, char ***names, uint64_t *cnt);